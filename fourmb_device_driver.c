@@ -9,13 +9,39 @@
 #include <linux/cdev.h>
 #include <linux/ioctl.h>
 #include <linux/string.h>
-#include <asm/uaccess.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/sched/mm.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/shmem_fs.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/moduleparam.h>
+#include <linux/crc32c.h>
+#include <linux/ratelimit.h>
+#include <linux/wait_bit.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
+#include <linux/uaccess.h>
 
 #define MAJOR_NUMBER 61 	// You can also try to get the device number automatically
 #define DEV_SIZE	 4194304	/* aka 4MB */
 #define SET_SIZE	 512
 #define NUM_SETS	 DEV_SIZE/SET_SIZE
-#define DEBUG
+#ifndef FOURMB_KUNIT_TEST
+#define DEBUG		/* per-byte printk would swamp the benchmarks */
+#endif
 #define MESSAGE_LEN  20
 #define FOURMB_DEBUG1
 
@@ -29,8 +55,93 @@
 #define FOURMB_IOC_STM		_IOW(FOURMB_IOC_MAGIC,2,unsigned long) /* write a message */
 #define FOURMB_IOC_LDM		_IOR(FOURMB_IOC_MAGIC,3,unsigned long) /* read a message*/
 #define FOURMB_IOC_LDSTM	_IOWR(FOURMB_IOC_MAGIC,4,unsigned long) /* Do both */
+#define FOURMB_IOC_MGET		_IOWR(FOURMB_IOC_MAGIC,5,struct fourmb_meta_kv) /* read a metadata entry */
+#define FOURMB_IOC_MPUT		_IOW(FOURMB_IOC_MAGIC,6,struct fourmb_meta_kv) /* write (or delete) an entry */
+#define FOURMB_IOC_MCAS		_IOWR(FOURMB_IOC_MAGIC,7,struct fourmb_meta_kv) /* compare and swap an entry */
+#define FOURMB_IOC_MBATCH	_IOW(FOURMB_IOC_MAGIC,8,struct fourmb_meta_batch) /* write many entries */
+#define FOURMB_IOC_WCOMBINE	_IO(FOURMB_IOC_MAGIC,9) /* arg != 0 stages small writes of this open */
 #define FOURMB_IOC_MAXNR	14
 
+/* metadata store */
+#define FOURMB_META_BITS		8	/* 256 buckets */
+#define FOURMB_META_MAX			4096	/* entries per device */
+#define FOURMB_META_BATCH_MAX	64
+#define FOURMB_META_KEYLEN		32
+#define FOURMB_META_VALLEN		64
+#define FOURMB_META_NAME		"name"	/* what STM/LDM/LDSTM work on */
+
+/* write combining, shorter writes are staged */
+#define FOURMB_WC_MAX			(SET_SIZE / 4)
+
+/*
+ * ioctl argument for MGET/MPUT/MCAS, strings
+ * are NUL terminated.
+ *
+ * MGET : key in, val out, -ENOENT if absent
+ * MPUT : key, val in, an empty val deletes
+ * MCAS : key, val, old in. val is stored only
+ *        if the current value equals old (an
+ *        absent key equals ""), otherwise
+ *        -EAGAIN. old always comes back with
+ *        the value that was there.
+ */
+struct fourmb_meta_kv {
+	char key[FOURMB_META_KEYLEN];
+	char val[FOURMB_META_VALLEN];
+	char old[FOURMB_META_VALLEN];
+};
+
+/* MBATCH : count MPUTs applied under one lock */
+struct fourmb_meta_batch {
+	__u32 count;
+	__u32 pad;
+	__u64 kvs;	/* user pointer to struct fourmb_meta_kv[count] */
+};
+
+/*
+ * shmem backing, off by default. shmem_mb
+ * sets the capacity, cache_pages how many
+ * pages are kept mapped (and resident) in
+ * front of it.
+ */
+static unsigned long shmem_mb = 0;
+module_param(shmem_mb, ulong, S_IRUGO);
+MODULE_PARM_DESC(shmem_mb, "Back the device with this many MB of swappable shmem (0: 4MB of kmalloc sets)");
+static unsigned int cache_pages = 256;
+module_param(cache_pages, uint, S_IRUGO);
+MODULE_PARM_DESC(cache_pages, "Pages kept mapped in front of the shmem backing (default 256)");
+
+/*
+ * Integrity mode : a CRC32C per set, checked
+ * on every read and by a background scrubber
+ * every scrub_interval_ms (0 disables it).
+ */
+static bool crc = false;
+module_param(crc, bool, S_IRUGO);
+MODULE_PARM_DESC(crc, "Keep a CRC32C per set and verify it on reads");
+static unsigned int scrub_interval_ms = 10000;
+module_param(scrub_interval_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(scrub_interval_ms, "Pause between two scrubs of all sets in crc mode, 0 to not scrub (default 10000)");
+#define FOURMB_CRC_LOCKS	64
+#define FOURMB_CRC32C_POLY	0x82f63b78	/* bit reflected, as crc32c() */
+
+/*
+ * Capture : calls are kept in a ring of
+ * trace_records that /proc/fourmb_trace
+ * drains, see fourmb_replay.c. A full ring
+ * drops new calls and counts them in
+ * trace_lost.
+ */
+static unsigned int trace_records = 0;
+module_param(trace_records, uint, S_IRUGO);
+MODULE_PARM_DESC(trace_records, "Trace ring size in records, rounded up to a power of two; new calls are dropped and counted in trace_lost while it is full (0: no capture)");
+
+/* async I/O, requests are split into chunks of this many sets */
+#define FOURMB_AIO_CHUNK_SETS	64
+
+/* O_APPEND, waiters are spread over this many wake addresses */
+#define FOURMB_APPEND_WAIT_BITS	6
+
 int fourmb_major = MAJOR_NUMBER;
 int fourmb_minor = 0;
 
@@ -48,6 +159,118 @@ struct fourmb_ll {
 	struct fourmb_ll* next;
 };
 
+/* The Metadata Store :
+ * ---------------------
+ *
+ * Named strings hashed into dev->meta.
+ * Entries are never modified in place, an
+ * update swaps in a new entry and frees the
+ * old one after a grace period, so lookups
+ * only need rcu_read_lock(). Updates take
+ * dev->meta_lock.
+ */
+struct fourmb_meta {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	u32 hash;
+	char key[FOURMB_META_KEYLEN];
+	char val[FOURMB_META_VALLEN];
+};
+
+/* Counters, shown in /proc/fourmb_device */
+struct fourmb_stats {
+	atomic_long_t aio_inflight;		/* queue depth */
+	atomic_long_t aio_submitted;
+	atomic_long_t aio_completed;
+	atomic64_t aio_lat_ns;			/* sum over completed */
+	atomic64_t aio_lat_max_ns;
+	/* bumped on every hit or read, so per cpu */
+	unsigned long __percpu *pcache_hits;	/* shmem backing only */
+	unsigned long __percpu *pcache_misses;
+	unsigned long __percpu *crc_verified;	/* crc mode only */
+	atomic_long_t crc_mismatch;
+	atomic_long_t scrub_passes;
+	atomic_long_t scrub_mismatch;
+	atomic_long_t wc_staged;		/* write combining only */
+	atomic_long_t wc_flushes;
+};
+
+/*
+ * One traced call, as read from
+ * /proc/fourmb_trace. This layout is ABI,
+ * fourmb_replay.c has a copy, only append.
+ */
+#define FOURMB_TRACE_READ		1
+#define FOURMB_TRACE_WRITE		2
+#define FOURMB_TRACE_LSEEK		3
+#define FOURMB_TRACE_IOCTL		4
+
+#define FOURMB_TRACE_F_APPEND	0x1	/* O_APPEND / IOCB_APPEND write */
+#define FOURMB_TRACE_F_ASYNC	0x2	/* async kiocb */
+
+struct fourmb_trace_rec {
+	__u64 ts_ns;			/* ktime_get_ns() on entry */
+	__u64 off;			/* file offset, lseek offset, ioctl arg */
+	__u32 len;			/* byte count, lseek whence, ioctl cmd */
+	__u32 pid;
+	__u16 op;			/* FOURMB_TRACE_*, 0 while being filled */
+	__u16 flags;			/* FOURMB_TRACE_F_* */
+	__u32 cpu;
+};
+
+/*
+ * The ring is multi producer, single consumer.
+ * A producer claims slot head by cmpxchg, and
+ * drops the record (counted in lost) if the
+ * consumer is a whole ring behind. It fills
+ * the slot and commits it by storing op last,
+ * with release. The consumer, under drain_lock,
+ * takes slots in order while op is set, clears
+ * op and moves tail on.
+ */
+struct fourmb_trace {
+	struct fourmb_trace_rec *ring;	/* NULL unless capturing */
+	unsigned long mask;
+	atomic_long_t head;
+	unsigned long tail;
+	atomic_long_t lost;
+	struct mutex drain_lock;
+};
+
+/*
+ * one slot of the shmem page cache, direct mapped
+ * on the page index, locked on its own so that
+ * hits on different slots do not contend
+ */
+struct fourmb_pcache_slot {
+	spinlock_t lock;
+	pgoff_t index;
+	struct page *page;	/* holds a reference, NULL if empty */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Locking :
+ *
+ * sem is held for reading by every read and
+ * write, for writing only when the sets are
+ * freed. alloc_lock serializes growth of the
+ * list and of set data. Nodes and data are
+ * published with release stores and never
+ * moved, so lookups walk the list and copies
+ * run without taking any lock. size
+ * only grows while sem is held for reading,
+ * see fourmb_size_extend().
+ *
+ * O_APPEND writers reserve their range by a
+ * fetch-add on append_tail and publish it by
+ * moving size past it once every earlier
+ * reservation is published, see
+ * fourmb_append(). Readers load size with
+ * acquire and so only see whole records.
+ * fourmb_device_clean() bumps append_gen so
+ * that appenders waiting across it drop their
+ * record instead of publishing it.
+ */
 struct fourmb_dev {
 	struct fourmb_ll* buf_list;
 	/* 
@@ -60,38 +283,150 @@ struct fourmb_dev {
 	 * 4. How do we clear this then ? 
 	 */
 	unsigned long size;
+	atomic_long_t append_tail;	/* end of the last reservation, >= size */
+	unsigned long append_gen;	/* bumped by every clean */
+	u8 append_wait[1 << FOURMB_APPEND_WAIT_BITS];	/* wake addresses, by record start */
+	void **set_index;		/* set data by index, once preallocated */
+	unsigned long capacity;		/* DEV_SIZE, or shmem_mb */
+	/*
+	 * With shmem backing the sets are slices of
+	 * the pages of this file and buf_list stays
+	 * empty, see fourmb_set_get().
+	 */
+	struct file *shmem;
+	struct fourmb_pcache_slot *pcache;
+	unsigned int pcache_nr;
+	/*
+	 * crc mode, crc[idx] covers all of set idx.
+	 * crc_locks are hashed on the set index and
+	 * held across a copy and its crc update or
+	 * check, so the two are always consistent.
+	 */
+	u32 *crc;
+	u32 crc_zero;			/* crc of a set never written */
+	unsigned long nr_sets;
+	struct mutex crc_locks[FOURMB_CRC_LOCKS];
+	u8 *crc_bounce;			/* SET_SIZE bytes per crc lock */
+	struct task_struct *scrub_task;
+	struct rw_semaphore sem;
+	struct mutex alloc_lock;
+	struct fourmb_stats stats;
+	struct fourmb_trace trace;
 	struct cdev cdev;
-	char dev_msg[MESSAGE_LEN];	// used in ioctl method.
+	DECLARE_HASHTABLE(meta, FOURMB_META_BITS);	// used in ioctl method.
+	spinlock_t meta_lock;
+	unsigned int meta_count;
+	u32 meta_seed;			/* keeps user keys from being aimed at one bucket */
+};
+
+/* The Per-Open State :
+ * ---------------------
+ *
+ * Hangs off filep->private_data. With
+ * FOURMB_IOC_WCOMBINE set, writes shorter than
+ * FOURMB_WC_MAX that start inside or right
+ * after the staged range, in the same set, are
+ * copied into wc_buf instead of the sets. The
+ * range is written back by fourmb_wc_flush()
+ * when it reaches the end of its set, when a
+ * write does not fit it, on fsync and close,
+ * and before this open reads over it or past
+ * the device size, seeks to the end or writes
+ * through write_iter over it. Other opens see
+ * staged bytes only after the write back, and
+ * the device size does not cover them until
+ * then.
+ */
+struct fourmb_file {
+	struct fourmb_dev *dev;
+	struct mutex wc_lock;
+	char *wc_buf;			/* SET_SIZE bytes, NULL unless combining */
+	unsigned long wc_pos;		/* device offset of wc_buf[0] */
+	unsigned int wc_len;		/* bytes staged */
 };
 
+static inline struct fourmb_dev *fourmb_file_dev(struct file *filep) {
+	return ((struct fourmb_file *)filep->private_data)->dev;
+}
+
 struct fourmb_dev* fourmb_device; /* Device Instance */
+static struct workqueue_struct* fourmb_aio_wq;
+static struct proc_dir_entry* fourmb_proc;
+static struct proc_dir_entry* fourmb_trace_proc;
 
 /* forward declaration */
 int fourmb_open(struct inode* inode, struct file* filep);
 int fourmb_release(struct inode* inode, struct file* filep);
+int fourmb_flush(struct file* filep, fl_owner_t id);
+int fourmb_fsync(struct file* filep, loff_t start, loff_t end, int datasync);
 ssize_t fourmb_read(struct file* filep, char* buf, size_t count, loff_t* f_pos);
 ssize_t fourmb_write(struct file* filep, const char* buf, size_t count, loff_t* f_pos);
+ssize_t fourmb_read_iter(struct kiocb* iocb, struct iov_iter* to);
+ssize_t fourmb_write_iter(struct kiocb* iocb, struct iov_iter* from);
+ssize_t fourmb_append(struct fourmb_dev*, struct iov_iter* from, loff_t* f_pos);
 loff_t fourmb_lseek(struct file* filep, loff_t, int whence);
 long fourmb_ioctl(struct file* filep, unsigned int, unsigned long);
 int fourmb_device_clean(struct fourmb_dev*);
+void fourmb_dev_init(struct fourmb_dev*);
+int fourmb_shmem_setup(struct fourmb_dev*, unsigned long capacity, unsigned int nr_cache);
+void fourmb_shmem_release(struct fourmb_dev*);
+int fourmb_crc_setup(struct fourmb_dev*);
+void fourmb_crc_release(struct fourmb_dev*);
+int fourmb_trace_setup(struct fourmb_dev*, unsigned int nr);
+void fourmb_trace_release(struct fourmb_dev*);
+unsigned long fourmb_scrub_pass(struct fourmb_dev*, bool from_thread);
+void fourmb_meta_init(struct fourmb_dev*);
+void fourmb_meta_clean(struct fourmb_dev*);
 
 /* definition of file operation structure */
 struct file_operations fourmb_fops = {
 	.read 			= fourmb_read,
 	.write 			= fourmb_write,
+	.read_iter		= fourmb_read_iter,
+	.write_iter		= fourmb_write_iter,
 	.open 			= fourmb_open,
 	.release 		= fourmb_release,
+	.flush			= fourmb_flush,
+	.fsync			= fourmb_fsync,
 	.llseek			= fourmb_lseek,
 	.unlocked_ioctl	= fourmb_ioctl,
 };
 
+static void __fourmb_trace(struct fourmb_trace *trace, u16 op, u16 flags, u64 off, u32 len);
+
+static inline void fourmb_trace(struct fourmb_dev *dev, u16 op, u16 flags, u64 off, u32 len) {
+	if(READ_ONCE(dev->trace.ring))
+		__fourmb_trace(&dev->trace, op, flags, off, len);
+}
+
+static int fourmb_prealloc(struct fourmb_dev *dev);
+static int fourmb_wc_sync(struct fourmb_file *file, unsigned long start, unsigned long end);
+static int fourmb_wc_sync_read(struct fourmb_file *file, unsigned long start, unsigned long end);
+static ssize_t fourmb_wc_write(struct fourmb_file *file, const char __user *buf, size_t count, loff_t *f_pos);
+
 int fourmb_open(struct inode* inode, struct file* filep) {
 	struct fourmb_dev *dev;
+	struct fourmb_file *file;
 	dev = container_of(inode->i_cdev, struct fourmb_dev, cdev);
-	filep->private_data = dev;
 
-	if((filep->f_flags & O_ACCMODE) == O_WRONLY) {
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if(!file)
+		return -ENOMEM;
+	file->dev = dev;
+	mutex_init(&file->wc_lock);
+	filep->private_data = file;
+
+	/* appenders add to the log instead of truncating it */
+	if((filep->f_flags & O_ACCMODE) == O_WRONLY && !(filep->f_flags & O_APPEND)) {
+		down_write(&dev->sem);
 		fourmb_device_clean(dev);
+		up_write(&dev->sem);
+	}
+	if((filep->f_flags & O_APPEND) && !dev->shmem && !READ_ONCE(dev->set_index)) {
+		down_write(&dev->sem);
+		if(!dev->set_index && fourmb_prealloc(dev))
+			printk(KERN_ERR "fourmb_device: Unable to preallocate the sets, appends will lock\n");
+		up_write(&dev->sem);
 	}
 	#ifdef DEBUG
 	printk(KERN_INFO "fourmb_device: Device Successfully opened");
@@ -100,71 +435,363 @@ int fourmb_open(struct inode* inode, struct file* filep) {
 }
 
 int fourmb_release(struct inode* inode, struct file* filep) {
-	return 0; 
+	struct fourmb_file *file = filep->private_data;
+
+	/* fourmb_flush() already reported any error */
+	fourmb_wc_sync(file, 0, ULONG_MAX);
+	kfree(file->wc_buf);
+	kfree(file);
+	return 0;
+}
+
+int fourmb_flush(struct file* filep, fl_owner_t id) {
+	return fourmb_wc_sync(filep->private_data, 0, ULONG_MAX);
+}
+
+int fourmb_fsync(struct file* filep, loff_t start, loff_t end, int datasync) {
+	return fourmb_wc_sync(filep->private_data, start, end == LLONG_MAX ? ULONG_MAX : end + 1);
+}
+
+/*
+ * The node *link points to. Linked nodes are
+ * followed without a lock, alloc_lock is only
+ * taken to link a missing one (with create).
+ */
+static struct fourmb_ll *fourmb_ll_follow(struct fourmb_dev *dev, struct fourmb_ll **link, bool create) {
+	struct fourmb_ll *ll = smp_load_acquire(link);
+
+	if(ll || !create)
+		return ll;
+
+	mutex_lock(&dev->alloc_lock);
+	ll = *link;
+	if(!ll) {
+		ll = kzalloc(sizeof(struct fourmb_ll), GFP_KERNEL);
+		if(ll)
+			smp_store_release(link, ll);
+		else
+			printk(KERN_ERR "fourmb_device: kmalloc failed to allocate a set\n");
+	}
+	mutex_unlock(&dev->alloc_lock);
+	return ll;
 }
 
-struct fourmb_ll *compute_dev_idx_ptr(struct fourmb_dev *dev, int idx) {
+/* node of set idx, NULL past the end of the list without create */
+static struct fourmb_ll *fourmb_ll_lookup(struct fourmb_dev *dev, unsigned long idx, bool create) {
+	struct fourmb_ll *ll;
 
 	if(idx >= NUM_SETS) {
 		printk(KERN_ERR "fourmb_device: Maximum Number of sets reached\n");
 		return NULL;
 	}
 
-	struct fourmb_ll *ll = dev->buf_list;
+	/* follow the list */
+	ll = fourmb_ll_follow(dev, &dev->buf_list, create);
+	while(ll && idx--)
+		ll = fourmb_ll_follow(dev, &ll->next, create);
+	return ll;
+}
+
+static struct fourmb_ll *compute_dev_idx_ptr(struct fourmb_dev *dev, int idx) {
+	return fourmb_ll_lookup(dev, idx, true);
+}
 
-	if(!ll) {
-		ll = dev->buf_list = kmalloc(sizeof(struct fourmb_ll), GFP_KERNEL);
-		if (ll == NULL) {
-			printk(KERN_ERR "fourmb_device: kmalloc failed to allocate a set 1\n");
-			return NULL;
+/* data of a set, allocated zeroed on first use */
+static void *fourmb_set_data(struct fourmb_dev *dev, struct fourmb_ll *ll) {
+	void *data = smp_load_acquire(&ll->data);
+
+	if(data)
+		return data;
+
+	mutex_lock(&dev->alloc_lock);
+	data = ll->data;
+	if(!data) {
+		data = kzalloc(SET_SIZE, GFP_KERNEL);
+		if(data)
+			smp_store_release(&ll->data, data);
+	}
+	mutex_unlock(&dev->alloc_lock);
+	return data;
+}
+
+/* set data of a node, NULL for a hole without create */
+static void *fourmb_ll_data(struct fourmb_dev *dev, struct fourmb_ll *ll, bool create) {
+	if(!ll)
+		return create ? ERR_PTR(-ENOMEM) : NULL;
+	if(!create)
+		return smp_load_acquire(&ll->data);
+	return fourmb_set_data(dev, ll) ? : ERR_PTR(-ENOMEM);
+}
+
+/* returns a referenced shmem page, through the page cache slots */
+static struct page *fourmb_shmem_page(struct fourmb_dev *dev, pgoff_t index) {
+	struct fourmb_pcache_slot *slot = NULL;
+	struct page *page, *old;
+
+	if(dev->pcache_nr) {
+		slot = &dev->pcache[index % dev->pcache_nr];
+		spin_lock(&slot->lock);
+		page = slot->page;
+		if(page && slot->index == index) {
+			get_page(page);
+			spin_unlock(&slot->lock);
+			this_cpu_inc(*dev->stats.pcache_hits);
+			return page;
 		}
-		memset(ll,0,sizeof(struct fourmb_ll));
+		spin_unlock(&slot->lock);
 	}
 
-	/* follow the list */
-	while(idx--) {
-		if(!ll->next) {
-			ll->next = kmalloc(sizeof(struct fourmb_ll), GFP_KERNEL);
-			if (ll->next == NULL) {
-				printk(KERN_ERR "fourmb_device: kmalloc failed to allocate a set 2\n");
-				return NULL;
-			}
-			memset(ll->next,0,sizeof(struct fourmb_ll));
+	/* swaps the page back in if it was reclaimed */
+	page = shmem_read_mapping_page(dev->shmem->f_mapping, index);
+	if(IS_ERR(page))
+		return page;
+	this_cpu_inc(*dev->stats.pcache_misses);
+
+	if(slot) {
+		get_page(page);
+		spin_lock(&slot->lock);
+		old = slot->page;
+		slot->page = page;
+		slot->index = index;
+		spin_unlock(&slot->lock);
+		if(old)
+			put_page(old);
+	}
+	return page;
+}
+
+/* Set access :
+ * ------------
+ *
+ * Kernel address of set idx for either
+ * backing, an ERR_PTR on failure. Without
+ * create a kmalloc hole comes back NULL
+ * (shmem has no holes). Anything else must go
+ * back through fourmb_set_put(), which marks
+ * written shmem pages dirty so that reclaim
+ * swaps them out instead of dropping them.
+ */
+static void *fourmb_set_get(struct fourmb_dev *dev, unsigned long idx, bool create, struct page **pagep) {
+	struct fourmb_ll *ll;
+	struct page *page;
+	unsigned long off;
+
+	*pagep = NULL;
+	if(dev->shmem) {
+		off  = idx * SET_SIZE;
+		page = fourmb_shmem_page(dev, off >> PAGE_SHIFT);
+		if(IS_ERR(page))
+			return page;
+		*pagep = page;
+		return kmap_local_page(page) + offset_in_page(off);
+	}
+
+	/* preallocated, no locks */
+	if(dev->set_index && idx < NUM_SETS)
+		return dev->set_index[idx];
+
+	ll = fourmb_ll_lookup(dev, idx, create);
+	return fourmb_ll_data(dev, ll, create);
+}
+
+static void fourmb_set_put(void *data, struct page *page, bool dirty) {
+	if(!page)
+		return;
+	kunmap_local(data);
+	if(dirty)
+		set_page_dirty(page);
+	put_page(page);
+}
+
+/* crc mode helpers, no-ops when it is off */
+static void fourmb_crc_lock(struct fourmb_dev *dev, unsigned long idx) {
+	if(dev->crc)
+		mutex_lock(&dev->crc_locks[idx % FOURMB_CRC_LOCKS]);
+}
+
+static void fourmb_crc_unlock(struct fourmb_dev *dev, unsigned long idx) {
+	if(dev->crc)
+		mutex_unlock(&dev->crc_locks[idx % FOURMB_CRC_LOCKS]);
+}
+
+/* x^(8z) mod P, appends z zero bytes to a zero seeded crc */
+static u32 fourmb_crc_shift[SET_SIZE + 1];
+
+/* a * b mod P, both bit reflected */
+static u32 fourmb_crc_mult(u32 a, u32 b) {
+	u32 m = 1U << 31, p = 0;
+
+	while(a) {
+		if(a & m) {
+			p ^= b;
+			a &= ~m;
 		}
-		ll = ll->next;
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ FOURMB_CRC32C_POLY : b >> 1;
 	}
-	return ll;
+	return p;
+}
+
+/*
+ * Copies n bytes of src to set_off of set idx
+ * and folds the change into its crc, under the
+ * set's crc lock. CRC32C is linear, so
+ * crc(new) = crc(old) ^ crc0(old ^ new) where
+ * crc0 has a zero seed. The difference is zero
+ * before set_off, which crc0 skips for free,
+ * and after it, which is one multiplication by
+ * x^(8 * trailing bytes). The cost follows n,
+ * not SET_SIZE.
+ */
+static void fourmb_crc_write(struct fourmb_dev *dev, unsigned long idx, void *data,
+		unsigned int set_off, const u8 *src, size_t n) {
+	u8 *dst = data + set_off, delta[64];
+	size_t i, j, m;
+	u32 c = 0;
+
+	for(i = 0; i < n; i += m) {
+		m = min_t(size_t, n - i, sizeof(delta));
+		for(j = 0; j < m; j++)
+			delta[j] = dst[i + j] ^ src[i + j];
+		c = crc32c(c, delta, m);
+	}
+	c = fourmb_crc_mult(fourmb_crc_shift[SET_SIZE - set_off - n], c);
+	memcpy(dst, src, n);
+	dev->crc[idx] ^= c;
+}
+
+/* the crc lock's bounce buffer, the old bytes stay in the set until the delta is taken */
+static u8 *fourmb_crc_bounce(struct fourmb_dev *dev, unsigned long idx) {
+	return dev->crc_bounce + (idx % FOURMB_CRC_LOCKS) * SET_SIZE;
+}
+
+/* the write copies in crc mode */
+static unsigned long fourmb_crc_copy_from_user(struct fourmb_dev *dev, unsigned long idx, void *data,
+		unsigned int set_off, const char __user *buf, size_t n) {
+	unsigned long left;
+
+	fourmb_crc_lock(dev, idx);
+	left = copy_from_user(fourmb_crc_bounce(dev, idx), buf, n);
+	fourmb_crc_write(dev, idx, data, set_off, fourmb_crc_bounce(dev, idx), n - left);
+	fourmb_crc_unlock(dev, idx);
+	return left;
+}
+
+static size_t fourmb_crc_copy_from_iter(struct fourmb_dev *dev, unsigned long idx, void *data,
+		unsigned int set_off, size_t n, struct iov_iter *iter) {
+	size_t copied;
+
+	fourmb_crc_lock(dev, idx);
+	copied = copy_from_iter(fourmb_crc_bounce(dev, idx), n, iter);
+	fourmb_crc_write(dev, idx, data, set_off, fourmb_crc_bounce(dev, idx), copied);
+	fourmb_crc_unlock(dev, idx);
+	return copied;
+}
+
+static bool fourmb_crc_check(struct fourmb_dev *dev, unsigned long idx, const void *data) {
+	return crc32c(~0, data, SET_SIZE) == dev->crc[idx];
+}
+
+/* before a read from set idx, under its crc lock */
+static bool fourmb_crc_verify(struct fourmb_dev *dev, unsigned long idx, const void *data) {
+	if(!dev->crc || !data)
+		return true;
+	this_cpu_inc(*dev->stats.crc_verified);
+	if(fourmb_crc_check(dev, idx, data))
+		return true;
+	atomic_long_inc(&dev->stats.crc_mismatch);
+	printk_ratelimited(KERN_ERR "fourmb_device: CRC mismatch in set %lu\n", idx);
+	return false;
+}
+
+/*
+ * Allocates every set up front and indexes
+ * them, so that fourmb_set_get() takes no
+ * lock. kmalloc backing only, caller holds
+ * dev->sem for writing.
+ */
+static int fourmb_prealloc(struct fourmb_dev *dev) {
+	struct fourmb_ll *ll;
+	unsigned long idx;
+	void **index;
+
+	index = kvmalloc_array(NUM_SETS, sizeof(*index), GFP_KERNEL);
+	if(!index)
+		return -ENOMEM;
+	if(!compute_dev_idx_ptr(dev, NUM_SETS - 1))
+		goto fail;
+	for(idx = 0, ll = dev->buf_list; ll; ll = ll->next, idx++) {
+		index[idx] = fourmb_set_data(dev, ll);
+		if(!index[idx])
+			goto fail;
+	}
+	dev->set_index = index;
+	return 0;
+	fail:
+		kvfree(index);
+		return -ENOMEM;
+}
+
+/* grows dev->size to at least end, and append_tail with it */
+static void fourmb_size_extend(struct fourmb_dev *dev, unsigned long end) {
+	unsigned long old = READ_ONCE(dev->size), prev;
+	long tail;
+
+	while(end > old) {
+		prev = cmpxchg(&dev->size, old, end);
+		if(prev == old)
+			break;
+		old = prev;
+	}
+
+	tail = atomic_long_read(&dev->append_tail);
+	while((unsigned long)tail < end && !atomic_long_try_cmpxchg(&dev->append_tail, &tail, end))
+		;
 }
 
 ssize_t fourmb_read(struct file* filep, char* buf, size_t count, loff_t* f_pos) {
 	ssize_t retval = 0;
-	unsigned int list_idx, set_off, file_pos;
-	struct fourmb_ll* list_idx_ptr;
-	struct fourmb_dev *dev = filep->private_data;
+	unsigned long list_idx, file_pos, size;
+	unsigned int set_off;
+	struct page* page;
+	void* data;
+	struct fourmb_dev *dev = fourmb_file_dev(filep);
 
 	file_pos 	= (unsigned long)(*f_pos);
+	fourmb_trace(dev, FOURMB_TRACE_READ, 0, file_pos, count);
+	retval = fourmb_wc_sync_read(filep->private_data, file_pos, file_pos + count);
+	if(retval)
+		return retval;
+	down_read(&dev->sem);
+	size		= smp_load_acquire(&dev->size);
 
 	#ifdef DEBUG
 	char written;
-	printk(KERN_DEBUG "fourmb_device: file_pos = %d, count = %d for reads\n",file_pos,count);
+	printk(KERN_DEBUG "fourmb_device: file_pos = %lu, count = %zu for reads\n",file_pos,count);
 	#endif
 	
-	if(file_pos > dev->size) {
+	if(file_pos > size) {
 		printk(KERN_ERR "fourmb_device: Offset out of bound\n");
 		goto out;
 	}
 
 	/* trim the count value */
-	if(file_pos + count > dev->size) {
-		count = dev->size - file_pos;
+	if(file_pos + count > size) {
+		count = size - file_pos;
 	}
 	
 	/* resolve the indices */
 	list_idx = file_pos / SET_SIZE;
 	set_off  = file_pos % SET_SIZE;
-	list_idx_ptr = compute_dev_idx_ptr(dev,list_idx);
+	data = fourmb_set_get(dev,list_idx,false,&page);
 	
-	if(!list_idx_ptr || !list_idx_ptr->data) {
+	/* shmem can fail to find memory or swap the page in */
+	if(IS_ERR(data)) {
+		printk(KERN_ERR "fourmb_device: Unable to get the set while reading\n");
+		retval = PTR_ERR(data);
+		goto out;
+	}
+	if(!data) {
 		printk(KERN_ERR "fourmb_device: Holes encountered while read, How ??\n");
 		goto out;
 	}
@@ -174,95 +801,647 @@ ssize_t fourmb_read(struct file* filep, char* buf, size_t count, loff_t* f_pos)
 		count = SET_SIZE - set_off;
 	}
 		
-	if (copy_to_user(buf, list_idx_ptr->data + set_off, count)) {
+	fourmb_crc_lock(dev,list_idx);
+	if(!fourmb_crc_verify(dev,list_idx,data)) {
+		fourmb_crc_unlock(dev,list_idx);
+		retval = -EIO;
+		goto put;
+	}
+	retval = copy_to_user(buf, data + set_off, count);
+	fourmb_crc_unlock(dev,list_idx);
+	if (retval) {
 		printk(KERN_ERR "fourmb_device: Copy to user failure\n");
 		retval = count;
-		goto out;
+		goto put;
 	}
 
 	*f_pos += count;
 	retval = count;
+	put:
+		fourmb_set_put(data,page,false);
 	out:
+		up_read(&dev->sem);
 		return retval;
 }
 
 ssize_t fourmb_write(struct file* filep, const char* buf, size_t count, loff_t* f_pos) {
 	
 	ssize_t retval = 0;
-	unsigned int list_idx, set_off;
-	struct fourmb_dev* dev = filep->private_data;
-	struct fourmb_ll* list_idx_ptr;
+	unsigned long list_idx;
+	unsigned int set_off;
+	struct fourmb_dev* dev = fourmb_file_dev(filep);
+	struct page* page;
 	
 	/* file offset bounds */
 	unsigned long file_pos 	  = (unsigned long)(*f_pos);
+	void *data;
+
+	fourmb_trace(dev, FOURMB_TRACE_WRITE,
+			(filep->f_flags & O_APPEND) ? FOURMB_TRACE_F_APPEND : 0, file_pos, count);
+
+	/* records go in whole, at the end */
+	if(filep->f_flags & O_APPEND) {
+		struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = count };
+		struct iov_iter from;
+
+		retval = fourmb_wc_sync(filep->private_data, 0, ULONG_MAX);
+		if(retval)
+			return retval;
+		iov_iter_init(&from, WRITE, &iov, 1, count);
+		return fourmb_append(dev, &from, f_pos);
+	}
+
+	/* staged, or the staged range is written back and we go on */
+	retval = fourmb_wc_write(filep->private_data, buf, count, f_pos);
+	if(retval)
+		return retval;
+
+	down_read(&dev->sem);
 
 	/* Do a bounds checking */
-	if(file_pos > DEV_SIZE) {
+	if(file_pos >= dev->capacity) {
 		printk(KERN_ERR "fourmb_device: Write limit to device exceeded\n");
 		goto out;
 	}
 
 	#ifdef DEBUG
 	char written;
-	printk(KERN_DEBUG "fourmb_device: file_pos = %d, count = %d\n",file_pos,count);
+	printk(KERN_DEBUG "fourmb_device: file_pos = %lu, count = %zu\n",file_pos,count);
 	#endif
 
 	/* resolve the indices */
 	list_idx 	 = file_pos / SET_SIZE;
 	set_off  	 = file_pos % SET_SIZE;
-	list_idx_ptr = compute_dev_idx_ptr(dev,list_idx);
+	data = fourmb_set_get(dev,list_idx,true,&page);
 	
-	if(list_idx_ptr == NULL) {
+	if(IS_ERR(data)) {
 		printk(KERN_ERR "fourmb_device: Unable to create sets while writing\n");
+		retval = PTR_ERR(data);
 		goto out;
 	}
 
-	if(!list_idx_ptr->data) {
-		list_idx_ptr->data = kmalloc(SET_SIZE,GFP_KERNEL);
-		if(!list_idx_ptr->data) {
-			printk(KERN_ERR "fourmb_device: Unable to create set offsets while writing\n");
-			goto out;
-		}
-		memset(list_idx_ptr->data,0,SET_SIZE);
-	}
-
 	/* Re-evaluate count, (you cannot write to more than one set) */
 	if ((set_off + count) > SET_SIZE) {
 		count = SET_SIZE - set_off;
 	}
 	
-	if(copy_from_user(list_idx_ptr->data + set_off,buf,count)) {
+	if(dev->crc)
+		retval = fourmb_crc_copy_from_user(dev,list_idx,data,set_off,buf,count);
+	else
+		retval = copy_from_user(data + set_off,buf,count);
+	if(retval) {
 		printk(KERN_ERR "fourmb_device: Unable to create copy from user while writing\n");
 		retval = -EFAULT;
-		goto out;
+		goto put;
 	}
 	#ifdef DEBUG
 	int j;
 	for(j = 0; j < count; j++) {
-		written = *(char *)(list_idx_ptr->data + j);
+		written = *(char *)(data + j);
 		printk(KERN_DEBUG "fourmb_device: character written  to the device = %c\n",written);
 	}
 	#endif
 
 	*f_pos += count;
 	retval = count;
-	if ((file_pos + count - 1) > dev->size)
-		dev->size = file_pos + count;
+	fourmb_size_extend(dev,file_pos + count);
 	
 	#ifdef DEBUG
-	printk(KERN_DEBUG "fourmb_device: Resultant file offset %d\n",*f_pos);
-	printk(KERN_DEBUG "fourmb_device: Bytes stored in the device %d\n",dev->size);
-	printk(KERN_DEBUG "fourmb_device: Bytes written %d\n",count);
+	printk(KERN_DEBUG "fourmb_device: Resultant file offset %lld\n",*f_pos);
+	printk(KERN_DEBUG "fourmb_device: Bytes stored in the device %lu\n",dev->size);
+	printk(KERN_DEBUG "fourmb_device: Bytes written %zu\n",count);
 	#endif
 	
+	put:
+		fourmb_set_put(data,page,true);
 	out:
+		up_read(&dev->sem);
+		return retval;
+}
+
+/*
+ * Moves len bytes between iter and the sets
+ * starting at pos, crossing set boundaries,
+ * holes read as zeroes. Caller holds dev->sem
+ * for reading, has bounded len and extends
+ * dev->size after writes. Returns the bytes
+ * moved, or an error if none were.
+ */
+static ssize_t fourmb_xfer(struct fourmb_dev *dev, struct iov_iter *iter,
+		loff_t pos, size_t len, bool write) {
+	unsigned long idx;
+	unsigned int set_off;
+	size_t done = 0, n, copied;
+	ssize_t retval = -EFAULT;
+	struct fourmb_ll *ll = NULL;
+	struct page *page;
+	void *data;
+
+	if(!len)
+		return 0;
+
+	while(done < len) {
+		set_off = (pos + done) % SET_SIZE;
+		n = min_t(size_t, len - done, SET_SIZE - set_off);
+		idx = (pos + done) / SET_SIZE;
+		if(dev->shmem || dev->set_index) {
+			data = fourmb_set_get(dev, idx, write, &page);
+		} else {
+			/* one walk to the first set, then next from there */
+			ll = done ? (ll ? fourmb_ll_follow(dev, &ll->next, write) : NULL) :
+					fourmb_ll_lookup(dev, idx, write);
+			data = fourmb_ll_data(dev, ll, write);
+			page = NULL;
+		}
+		if(IS_ERR(data)) {
+			retval = PTR_ERR(data);
+			break;
+		}
+		if(write && dev->crc) {
+			copied = fourmb_crc_copy_from_iter(dev, idx, data, set_off, n, iter);
+		} else if(write) {
+			copied = copy_from_iter(data + set_off, n, iter);
+		} else {
+			fourmb_crc_lock(dev, idx);
+			if(!fourmb_crc_verify(dev, idx, data)) {
+				copied = 0;
+				retval = -EIO;
+			} else {
+				copied = data ? copy_to_iter(data + set_off, n, iter) : iov_iter_zero(n, iter);
+			}
+			fourmb_crc_unlock(dev, idx);
+		}
+		fourmb_set_put(data, page, write);
+		done += copied;
+		if(copied < n)
+			break;
+	}
+	return done ? done : retval;
+}
+
+/* clamps a request at pos to the data (reads) or the device (writes) */
+static size_t fourmb_xfer_len(struct fourmb_dev *dev, loff_t pos, size_t len, bool write) {
+	unsigned long end = write ? dev->capacity : smp_load_acquire(&dev->size);
+
+	if(pos >= end)
+		return 0;
+	return min_t(size_t, len, end - pos);
+}
+
+/* Async I/O :
+ * -----------
+ *
+ * A kiocb that is not synchronous (aio,
+ * io_uring) is cut into chunks of
+ * FOURMB_AIO_CHUNK_SETS sets, each queued to
+ * fourmb_aio_wq on its own CPU. Workers borrow
+ * the submitter's mm to copy, the last one to
+ * finish calls ki_complete(). Only user backed
+ * iterators go this way, anything else is done
+ * synchronously.
+ */
+struct fourmb_aio;
+
+struct fourmb_aio_chunk {
+	struct work_struct work;
+	struct fourmb_aio *aio;
+	size_t off, len;	/* within the request */
+	ssize_t done;
+};
+
+struct fourmb_aio {
+	struct kiocb *iocb;
+	struct fourmb_dev *dev;
+	struct mm_struct *mm;
+	struct iovec *iov;
+	struct iov_iter iter;	/* whole request, chunks work on copies */
+	loff_t pos;
+	bool write;
+	u64 start_ns;
+	atomic_t pending;
+	unsigned int nr_chunks;
+	struct fourmb_aio_chunk chunks[];
+};
+
+static void fourmb_aio_complete(struct fourmb_aio *aio) {
+	struct fourmb_stats *st = &aio->dev->stats;
+	ssize_t res = 0;
+	u64 lat, max;
+	unsigned int i;
+
+	/* report the bytes up to the first short chunk */
+	for(i = 0; i < aio->nr_chunks; i++) {
+		if(aio->chunks[i].done < 0) {
+			if(!res)
+				res = aio->chunks[i].done;
+			break;
+		}
+		res += aio->chunks[i].done;
+		if(aio->chunks[i].done < aio->chunks[i].len)
+			break;
+	}
+	if(res > 0)
+		aio->iocb->ki_pos = aio->pos + res;
+
+	lat = ktime_get_ns() - aio->start_ns;
+	atomic64_add(lat, &st->aio_lat_ns);
+	max = atomic64_read(&st->aio_lat_max_ns);
+	while(lat > max && !atomic64_try_cmpxchg(&st->aio_lat_max_ns, &max, lat))
+		;
+	atomic_long_inc(&st->aio_completed);
+	atomic_long_dec(&st->aio_inflight);
+
+	aio->iocb->ki_complete(aio->iocb, res);
+	mmdrop(aio->mm);
+	kfree(aio->iov);
+	kvfree(aio);
+}
+
+static void fourmb_aio_work(struct work_struct *work) {
+	struct fourmb_aio_chunk *c = container_of(work, struct fourmb_aio_chunk, work);
+	struct fourmb_aio *aio = c->aio;
+	struct iov_iter iter = aio->iter;
+
+	c->done = -EFAULT;
+	if(mmget_not_zero(aio->mm)) {
+		iov_iter_advance(&iter, c->off);
+		iov_iter_truncate(&iter, c->len);
+
+		kthread_use_mm(aio->mm);
+		down_read(&aio->dev->sem);
+		c->done = fourmb_xfer(aio->dev, &iter, aio->pos + c->off, c->len, aio->write);
+		if(aio->write && c->done > 0)
+			fourmb_size_extend(aio->dev, aio->pos + c->off + c->done);
+		up_read(&aio->dev->sem);
+		kthread_unuse_mm(aio->mm);
+		mmput(aio->mm);
+	}
+
+	if(atomic_dec_and_test(&aio->pending))
+		fourmb_aio_complete(aio);
+}
+
+/* private copy of the user segments, they may live on the submitter's stack */
+static struct iovec *fourmb_aio_dup_iov(struct iov_iter *from, struct iov_iter *to) {
+	const struct iovec *src;
+	struct iovec *iov;
+	unsigned long nr;
+	size_t total = 0;
+	unsigned long i;
+
+	if(iter_is_ubuf(from)) {
+		iov = kmalloc(sizeof(*iov), GFP_KERNEL);
+		if(!iov)
+			return NULL;
+		iov->iov_base = from->ubuf + from->iov_offset;
+		iov->iov_len = iov_iter_count(from);
+		iov_iter_init(to, iov_iter_rw(from), iov, 1, iov->iov_len);
+		return iov;
+	}
+
+	src = iter_iov(from);
+	nr = from->nr_segs;
+	iov = kmemdup(src, nr * sizeof(*iov), GFP_KERNEL);
+	if(!iov)
+		return NULL;
+	for(i = 0; i < nr; i++)
+		total += iov[i].iov_len;
+	iov_iter_init(to, iov_iter_rw(from), iov, nr, total);
+	iov_iter_advance(to, from->iov_offset);
+	iov_iter_truncate(to, iov_iter_count(from));
+	return iov;
+}
+
+static ssize_t fourmb_aio_submit(struct kiocb *iocb, struct iov_iter *iter, size_t len, bool write) {
+	struct fourmb_dev *dev = fourmb_file_dev(iocb->ki_filp);
+	size_t chunk = FOURMB_AIO_CHUNK_SETS * SET_SIZE;
+	struct fourmb_aio *aio;
+	unsigned int i, nr;
+
+	/* chunks line up with set boundaries */
+	nr = DIV_ROUND_UP((iocb->ki_pos % chunk) + len, chunk);
+	/* a GB sized request on shmem needs MBs of chunks */
+	aio = kvzalloc(struct_size(aio, chunks, nr), GFP_KERNEL);
+	if(!aio)
+		return -ENOMEM;
+
+	iov_iter_truncate(iter, len);
+	aio->iov = fourmb_aio_dup_iov(iter, &aio->iter);
+	if(!aio->iov) {
+		kvfree(aio);
+		return -ENOMEM;
+	}
+	aio->iocb = iocb;
+	aio->dev = dev;
+	aio->mm = current->mm;
+	mmgrab(aio->mm);
+	aio->pos = iocb->ki_pos;
+	aio->write = write;
+	aio->start_ns = ktime_get_ns();
+	aio->nr_chunks = nr;
+	atomic_set(&aio->pending, nr);
+
+	for(i = 0; i < nr; i++) {
+		struct fourmb_aio_chunk *c = &aio->chunks[i];
+
+		c->aio = aio;
+		c->off = i ? aio->chunks[i - 1].off + aio->chunks[i - 1].len : 0;
+		c->len = min_t(size_t, len - c->off, chunk - ((aio->pos + c->off) % chunk));
+		INIT_WORK(&c->work, fourmb_aio_work);
+	}
+
+	atomic_long_inc(&dev->stats.aio_submitted);
+	atomic_long_inc(&dev->stats.aio_inflight);
+	/* the submitter's iterator is done with, as far as the caller knows */
+	iov_iter_advance(iter, len);
+
+	for(i = 0; i < nr; i++)
+		queue_work_on(cpumask_local_spread(i, numa_node_id()), fourmb_aio_wq,
+				&aio->chunks[i].work);
+	return -EIOCBQUEUED;
+}
+
+static ssize_t fourmb_rw_iter(struct kiocb *iocb, struct iov_iter *iter, bool write) {
+	struct fourmb_dev *dev = fourmb_file_dev(iocb->ki_filp);
+	size_t len;
+	ssize_t retval;
+
+	fourmb_trace(dev, write ? FOURMB_TRACE_WRITE : FOURMB_TRACE_READ,
+			(write && (iocb->ki_flags & IOCB_APPEND) ? FOURMB_TRACE_F_APPEND : 0) |
+			(is_sync_kiocb(iocb) ? 0 : FOURMB_TRACE_F_ASYNC),
+			iocb->ki_pos, iov_iter_count(iter));
+	if(iocb->ki_pos < 0)
+		return -EINVAL;
+	if(write && (iocb->ki_flags & IOCB_APPEND))
+		retval = fourmb_wc_sync(iocb->ki_filp->private_data, 0, ULONG_MAX);
+	else if(write)
+		retval = fourmb_wc_sync(iocb->ki_filp->private_data, iocb->ki_pos,
+				iocb->ki_pos + iov_iter_count(iter));
+	else
+		retval = fourmb_wc_sync_read(iocb->ki_filp->private_data, iocb->ki_pos,
+				iocb->ki_pos + iov_iter_count(iter));
+	if(retval)
 		return retval;
+	if(write && (iocb->ki_flags & IOCB_APPEND))
+		return fourmb_append(dev, iter, &iocb->ki_pos);
+	len = fourmb_xfer_len(dev, iocb->ki_pos, iov_iter_count(iter), write);
+	if(!len)
+		return 0;
+
+	if(!is_sync_kiocb(iocb) && (iter_is_ubuf(iter) || iter_is_iovec(iter)) && current->mm)
+		return fourmb_aio_submit(iocb, iter, len, write);
+
+	down_read(&dev->sem);
+	retval = fourmb_xfer(dev, iter, iocb->ki_pos, len, write);
+	if(write && retval > 0)
+		fourmb_size_extend(dev, iocb->ki_pos + retval);
+	up_read(&dev->sem);
+	if(retval > 0)
+		iocb->ki_pos += retval;
+	return retval;
+}
+
+/* overwrites [pos, pos + len) with zeroes, holes left by ENOMEM read as zeroes anyway */
+static void fourmb_zero_range(struct fourmb_dev *dev, unsigned long pos, size_t len) {
+	struct iov_iter iter;
+	struct kvec kv;
+	size_t n;
+
+	while(len) {
+		n = min_t(size_t, len, PAGE_SIZE);
+		kv.iov_base = page_address(ZERO_PAGE(0));
+		kv.iov_len = n;
+		iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, n);
+		if(fourmb_xfer(dev, &iter, pos, n, true) != n)
+			break;
+		pos += n;
+		len -= n;
+	}
+}
+
+/* what the appender whose record starts at pos waits on */
+static void *fourmb_append_var(struct fourmb_dev *dev, unsigned long pos) {
+	return &dev->append_wait[hash_long(pos, FOURMB_APPEND_WAIT_BITS)];
+}
+
+/*
+ * O_APPEND : the record gets [start, end) from
+ * a fetch-add on append_tail, is copied with
+ * no lock shared with other appenders, then
+ * waits for every earlier record to be
+ * published before publishing itself.
+ *
+ * Each appender waits on the address of its
+ * own start and wakes the one of its end, so
+ * a publication wakes only the next record's
+ * writer. The wait is uninterruptible and
+ * drops sem: a writer slow in its copy (say
+ * a userfaultfd or NFS backed buffer) stalls
+ * the writers of all later records, but not
+ * readers, plain writers or a truncating
+ * open. A clean meanwhile discards the
+ * records, the waiters return as if they had
+ * been written just before it.
+ *
+ * Records are whole or not at all. One that
+ * does not fit below capacity fails with
+ * -ENOSPC and publishes nothing, every later
+ * reservation starts past capacity and fails
+ * too. One whose copy faults is zeroed and
+ * still published, so a bad writer cannot
+ * stall the ones behind it, and fails with
+ * -EFAULT. Readers see it as a record of
+ * zeroes. Writes to explicit offsets past the
+ * tail are not ordered with appends in flight.
+ */
+ssize_t fourmb_append(struct fourmb_dev *dev, struct iov_iter *from, loff_t *f_pos) {
+	size_t len = iov_iter_count(from);
+	unsigned long start, gen;
+	ssize_t retval;
+
+	if(!len)
+		return 0;
+
+	down_read(&dev->sem);
+	gen = dev->append_gen;
+	start = atomic_long_fetch_add(len, &dev->append_tail);
+	if(start >= dev->capacity || len > dev->capacity - start) {
+		retval = -ENOSPC;
+		goto out;
+	}
+
+	retval = fourmb_xfer(dev, from, start, len, true);
+	if(retval != len) {
+		fourmb_zero_range(dev, start, len);
+		retval = -EFAULT;
+	}
+
+	/* publish in reservation order */
+	if(smp_load_acquire(&dev->size) < start) {
+		up_read(&dev->sem);
+		wait_var_event(fourmb_append_var(dev, start),
+				smp_load_acquire(&dev->size) >= start || READ_ONCE(dev->append_gen) != gen);
+		down_read(&dev->sem);
+	}
+	if(dev->append_gen == gen)
+		fourmb_size_extend(dev, start + len);
+	smp_mb();
+	wake_up_var(fourmb_append_var(dev, start + len));
+
+	if(retval > 0)
+		*f_pos = start + retval;
+	out:
+		up_read(&dev->sem);
+		return retval;
+}
+
+/* writes back the staged range, wc_lock held */
+static int fourmb_wc_flush(struct fourmb_file *file) {
+	struct fourmb_dev *dev = file->dev;
+	struct iov_iter iter;
+	struct kvec kv;
+	ssize_t retval;
+
+	if(!file->wc_len)
+		return 0;
+	kv.iov_base = file->wc_buf;
+	kv.iov_len = file->wc_len;
+	iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, file->wc_len);
+
+	/* the range never leaves its set, so this is all or nothing */
+	down_read(&dev->sem);
+	retval = fourmb_xfer(dev, &iter, file->wc_pos, file->wc_len, true);
+	if(retval > 0)
+		fourmb_size_extend(dev, file->wc_pos + retval);
+	up_read(&dev->sem);
+	if(retval < 0)
+		return retval;
+
+	file->wc_len = 0;
+	atomic_long_inc(&dev->stats.wc_flushes);
+	return 0;
+}
+
+/* writes back the staged range if it overlaps [start, end) */
+static int fourmb_wc_sync(struct fourmb_file *file, unsigned long start, unsigned long end) {
+	int retval = 0;
+
+	if(!READ_ONCE(file->wc_buf))
+		return 0;
+	mutex_lock(&file->wc_lock);
+	if(file->wc_len && file->wc_pos < end && start < file->wc_pos + file->wc_len)
+		retval = fourmb_wc_flush(file);
+	mutex_unlock(&file->wc_lock);
+	return retval;
+}
+
+/*
+ * Before a read of [start, end) : besides an
+ * overlap, a staged range past dev->size would
+ * move the size the read is trimmed to, so it
+ * is written back too when the read runs past
+ * the size.
+ */
+static int fourmb_wc_sync_read(struct fourmb_file *file, unsigned long start, unsigned long end) {
+	unsigned long size, wc_end;
+	int retval = 0;
+
+	if(!READ_ONCE(file->wc_buf))
+		return 0;
+	mutex_lock(&file->wc_lock);
+	size = smp_load_acquire(&file->dev->size);
+	wc_end = file->wc_pos + file->wc_len;
+	if(file->wc_len && ((file->wc_pos < end && start < wc_end) || (end > size && wc_end > size)))
+		retval = fourmb_wc_flush(file);
+	mutex_unlock(&file->wc_lock);
+	return retval;
+}
+
+/*
+ * Stages a small write. Returns count if it
+ * was staged, 0 if the caller has to write it
+ * to the sets, the staged range having been
+ * written back first, or an error.
+ */
+static ssize_t fourmb_wc_write(struct fourmb_file *file, const char __user *buf,
+		size_t count, loff_t *f_pos) {
+	unsigned long pos = *f_pos, end = pos + count;
+	ssize_t retval = 0;
+
+	if(!READ_ONCE(file->wc_buf))
+		return 0;
+	mutex_lock(&file->wc_lock);
+	if(!file->wc_buf)
+		goto out;
+
+	/* too big, past the end, or crossing a set */
+	if(!count || count >= FOURMB_WC_MAX || *f_pos < 0 || pos >= file->dev->capacity ||
+			pos / SET_SIZE != (end - 1) / SET_SIZE) {
+		retval = fourmb_wc_flush(file);
+		goto out;
+	}
+
+	/* has to start inside the staged range or right after it */
+	if(file->wc_len && (pos / SET_SIZE != file->wc_pos / SET_SIZE ||
+			pos < file->wc_pos || pos > file->wc_pos + file->wc_len)) {
+		retval = fourmb_wc_flush(file);
+		if(retval)
+			goto out;
+	}
+	if(!file->wc_len)
+		file->wc_pos = pos;
+
+	if(copy_from_user(file->wc_buf + (pos - file->wc_pos), buf, count)) {
+		retval = -EFAULT;
+		goto out;
+	}
+	file->wc_len = max_t(unsigned long, file->wc_len, end - file->wc_pos);
+	atomic_long_inc(&file->dev->stats.wc_staged);
+	*f_pos = end;
+	retval = count;
+
+	/* a full set goes out now */
+	if((file->wc_pos + file->wc_len) % SET_SIZE == 0)
+		fourmb_wc_flush(file);
+	out:
+		mutex_unlock(&file->wc_lock);
+		return retval;
+}
+
+/* turns write combining on or off for this open */
+static int fourmb_wc_set(struct fourmb_file *file, bool on) {
+	int retval = 0;
+
+	mutex_lock(&file->wc_lock);
+	if(on && !file->wc_buf) {
+		file->wc_buf = kmalloc(SET_SIZE, GFP_KERNEL);
+		if(!file->wc_buf)
+			retval = -ENOMEM;
+	} else if(!on && file->wc_buf) {
+		retval = fourmb_wc_flush(file);
+		if(!retval) {
+			kfree(file->wc_buf);
+			WRITE_ONCE(file->wc_buf, NULL);
+		}
+	}
+	mutex_unlock(&file->wc_lock);
+	return retval;
+}
+
+ssize_t fourmb_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	return fourmb_rw_iter(iocb, to, false);
+}
+
+ssize_t fourmb_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+	return fourmb_rw_iter(iocb, from, true);
 }
 
 loff_t fourmb_lseek(struct file* filep, loff_t off, int whence) {
-	struct fourmb_dev *dev = filep->private_data;
+	struct fourmb_dev *dev = fourmb_file_dev(filep);
 	loff_t newpos;
+	int retval;
 
+	fourmb_trace(dev, FOURMB_TRACE_LSEEK, 0, off, whence);
 	switch(whence) {
 		case SEEK_SET :
 			newpos = off;
@@ -273,8 +1452,14 @@ loff_t fourmb_lseek(struct file* filep, loff_t off, int whence) {
 			break;
 
 		case SEEK_END :
+			retval = fourmb_wc_sync(filep->private_data, 0, ULONG_MAX);
+			if(retval)
+				return retval;
 			newpos = dev->size + off;
 			break;
+
+		default :
+			return -EINVAL;
 	}
 
 	if(newpos < 0) return -EINVAL;
@@ -282,10 +1467,189 @@ loff_t fourmb_lseek(struct file* filep, loff_t off, int whence) {
 	return newpos;
 }
 
+static u32 fourmb_meta_hash(struct fourmb_dev *dev, const char *key) {
+	return jhash(key, strlen(key), dev->meta_seed);
+}
+
+/* caller holds rcu_read_lock() or dev->meta_lock */
+static struct fourmb_meta *fourmb_meta_find(struct fourmb_dev *dev, const char *key, u32 hash) {
+	struct fourmb_meta *m;
+
+	hash_for_each_possible_rcu(dev->meta, m, node, hash) {
+		if(m->hash == hash && !strcmp(m->key, key))
+			return m;
+	}
+	return NULL;
+}
+
+/* copies the value of key into val, lock free */
+static int fourmb_meta_get(struct fourmb_dev *dev, const char *key, char *val) {
+	struct fourmb_meta *m;
+	int retval = -ENOENT;
+
+	rcu_read_lock();
+	m = fourmb_meta_find(dev, key, fourmb_meta_hash(dev, key));
+	if(m) {
+		memcpy(val, m->val, FOURMB_META_VALLEN);
+		retval = 0;
+	}
+	rcu_read_unlock();
+	return retval;
+}
+
+static struct fourmb_meta *fourmb_meta_alloc(struct fourmb_dev *dev, const struct fourmb_meta_kv *kv) {
+	struct fourmb_meta *m;
+
+	if(!kv->val[0])
+		return NULL;	/* deletion, nothing to insert */
+	m = kmalloc(sizeof(*m), GFP_KERNEL);
+	if(!m)
+		return ERR_PTR(-ENOMEM);
+	memcpy(m->key, kv->key, FOURMB_META_KEYLEN);
+	memcpy(m->val, kv->val, FOURMB_META_VALLEN);
+	m->hash = fourmb_meta_hash(dev, m->key);
+	return m;
+}
+
+/*
+ * Replaces the entry for kv->key with new (NULL
+ * deletes it), see struct fourmb_meta_kv for
+ * cas. The previous value goes to kv->old. On
+ * success new belongs to the table, on failure
+ * it is still the caller's.
+ */
+static int fourmb_meta_update_locked(struct fourmb_dev *dev, struct fourmb_meta_kv *kv,
+		struct fourmb_meta *new, bool cas) {
+	struct fourmb_meta *cur;
+	char *prev = "";
+
+	lockdep_assert_held(&dev->meta_lock);
+
+	cur = fourmb_meta_find(dev, kv->key, fourmb_meta_hash(dev, kv->key));
+	if(cur)
+		prev = cur->val;
+	if(cas && strcmp(prev, kv->old)) {
+		strscpy(kv->old, prev, FOURMB_META_VALLEN);
+		return -EAGAIN;
+	}
+	strscpy(kv->old, prev, FOURMB_META_VALLEN);
+
+	if(cur && new) {
+		hlist_replace_rcu(&cur->node, &new->node);
+	} else if(cur) {
+		hash_del_rcu(&cur->node);
+		dev->meta_count--;
+	} else if(new) {
+		if(dev->meta_count >= FOURMB_META_MAX)
+			return -ENOSPC;
+		hash_add_rcu(dev->meta, &new->node, new->hash);
+		dev->meta_count++;
+	}
+	if(cur)
+		kfree_rcu(cur, rcu);
+	return 0;
+}
+
+static int fourmb_meta_update(struct fourmb_dev *dev, struct fourmb_meta_kv *kv, bool cas) {
+	struct fourmb_meta *new;
+	int retval;
+
+	new = fourmb_meta_alloc(dev, kv);
+	if(IS_ERR(new))
+		return PTR_ERR(new);
+
+	spin_lock(&dev->meta_lock);
+	retval = fourmb_meta_update_locked(dev, kv, new, cas);
+	spin_unlock(&dev->meta_lock);
+
+	if(retval)
+		kfree(new);
+	return retval;
+}
+
+/* in kernel put, for defaults */
+static int fourmb_meta_put(struct fourmb_dev *dev, const char *key, const char *val) {
+	struct fourmb_meta_kv kv;
+
+	memset(&kv, 0, sizeof(kv));
+	strscpy(kv.key, key, FOURMB_META_KEYLEN);
+	strscpy(kv.val, val, FOURMB_META_VALLEN);
+	return fourmb_meta_update(dev, &kv, false);
+}
+
+/* applies count puts under a single lock hold, stops at the first error */
+static int fourmb_meta_update_batch(struct fourmb_dev *dev, struct fourmb_meta_kv *kvs, unsigned int count) {
+	struct fourmb_meta **new;
+	unsigned int i, done = 0;
+	int retval = 0;
+
+	new = kcalloc(count, sizeof(*new), GFP_KERNEL);
+	if(!new)
+		return -ENOMEM;
+	for(i = 0; i < count; i++) {
+		new[i] = fourmb_meta_alloc(dev, &kvs[i]);
+		if(IS_ERR(new[i])) {
+			retval = PTR_ERR(new[i]);
+			new[i] = NULL;
+			goto out;
+		}
+	}
+
+	spin_lock(&dev->meta_lock);
+	for(done = 0; done < count; done++) {
+		retval = fourmb_meta_update_locked(dev, &kvs[done], new[done], false);
+		if(retval)
+			break;
+	}
+	spin_unlock(&dev->meta_lock);
+
+	out:
+		for(i = done; i < count; i++)
+			kfree(new[i]);
+		kfree(new);
+		return retval;
+}
+
+void fourmb_meta_init(struct fourmb_dev *dev) {
+	hash_init(dev->meta);
+	spin_lock_init(&dev->meta_lock);
+	dev->meta_count = 0;
+	dev->meta_seed = get_random_u32();
+}
+
+/* no readers may be left */
+void fourmb_meta_clean(struct fourmb_dev *dev) {
+	struct fourmb_meta *m;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(dev->meta, bkt, tmp, m, node) {
+		hash_del(&m->node);
+		kfree(m);
+	}
+	dev->meta_count = 0;
+	rcu_barrier();	/* entries still waiting in kfree_rcu */
+}
+
+/* pulls a kv from user space and makes sure its strings are terminated */
+static int fourmb_meta_copy_kv(struct fourmb_meta_kv *kv, const void __user *arg) {
+	if(copy_from_user(kv, arg, sizeof(*kv)))
+		return -EFAULT;
+	kv->key[FOURMB_META_KEYLEN - 1] = '\0';
+	kv->val[FOURMB_META_VALLEN - 1] = '\0';
+	kv->old[FOURMB_META_VALLEN - 1] = '\0';
+	return kv->key[0] ? 0 : -EINVAL;
+}
+
 long fourmb_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
-	struct fourmb_dev *dev = filep->private_data;
+	struct fourmb_dev *dev = fourmb_file_dev(filep);
 	int retval, err = 0;
-	char tmp_msg[MESSAGE_LEN];
+	struct fourmb_meta_kv kv;
+	struct fourmb_meta_batch batch;
+	struct fourmb_meta_kv *kvs;
+	unsigned int i;
+
+	fourmb_trace(dev, FOURMB_TRACE_IOCTL, 0, arg, cmd);
 
 	/* check for appropriate commands */
 	if (_IOC_TYPE(cmd) != FOURMB_IOC_MAGIC) return -ENOTTY;
@@ -293,9 +1657,9 @@ long fourmb_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
 
 	/* check for appropriate direction */
     if (_IOC_DIR(cmd) & _IOC_READ)
-        err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
+        err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
     else if (_IOC_DIR(cmd) & _IOC_WRITE)
-        err =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
+        err =  !access_ok((void __user *)arg, _IOC_SIZE(cmd));
     if (err) return -EFAULT;
 
 	switch(cmd) {
@@ -303,74 +1667,202 @@ long fourmb_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
 			printk(KERN_INFO "fourmb_device: hello ioctl usage \n");
 			break;
 
+		/*
+		 * The device name is the FOURMB_META_NAME
+		 * entry, these move MESSAGE_LEN bytes of it.
+		 */
 		case FOURMB_IOC_STM: /* write the device string */
-			//retval = __get_user(dev_msg, (void __user *)arg); // is this correct
-			//if(retval) {
-			//	printk(KERN_INFO "fourmb_device: ioctl device naming failed\n");
-			//	return retval;
-			//}
-
-			/* 
-			 * I seriously dont know why it works vis-a-vis the commented
-			 * code above and below, but never mind
-			 */
-			//dev->dev_msg	= (char *)arg;
-
-			if(copy_from_user(dev->dev_msg,(char *)arg,MESSAGE_LEN)) {
+			memset(&kv, 0, sizeof(kv));
+			strcpy(kv.key, FOURMB_META_NAME);
+			if(copy_from_user(kv.val,(char *)arg,MESSAGE_LEN)) {
 				printk(KERN_ERR "fourmb_device: ioctl failed to name the device\n");
 				return -ENOTTY;
 			}
-			printk(KERN_INFO "fourmb_device: ioctl naming the device as %s\n",dev->dev_msg);
-			//strcpy(dev->dev_msg,dev_msg);
-			break;
+			kv.val[MESSAGE_LEN - 1] = '\0';
+			return fourmb_meta_update(dev, &kv, false);
 
 		case FOURMB_IOC_LDM: /* read the device string */
-			if(copy_to_user((char *)arg,dev->dev_msg,MESSAGE_LEN)) {
+			memset(&kv, 0, sizeof(kv));
+			fourmb_meta_get(dev, FOURMB_META_NAME, kv.val);
+			kv.val[MESSAGE_LEN - 1] = '\0';
+			if(copy_to_user((char *)arg,kv.val,MESSAGE_LEN)) {
 				printk(KERN_ERR "fourmb_device: ioctl failed to retrieve the device name\n");
-				return -ENOTTY;	
+				return -ENOTTY;
 			}
 			break;
-		//	retval = __put_user(dev_msg,(char __user *)arg);
-		//	if(retval) {
-		//		printk(KERN_INFO "fourmb_device: ioctl device name retrieval failed\n");
-		//		return retval;
-		//	}
-		//	break;
-		case FOURMB_IOC_LDSTM:
-			if(copy_from_user(tmp_msg,(char *)arg,MESSAGE_LEN)) {
+
+		case FOURMB_IOC_LDSTM: /* swap, atomic with respect to other updates */
+			memset(&kv, 0, sizeof(kv));
+			strcpy(kv.key, FOURMB_META_NAME);
+			if(copy_from_user(kv.val,(char *)arg,MESSAGE_LEN)) {
 				printk(KERN_ERR "fourmb_device: ioctl failed to tmp_msg store the name for swap\n");
 				return -ENOTTY;
 			}
-			printk(KERN_INFO "fourmb_device: ioctl temporarily stored the name for swap %s\n",tmp_msg);
-			if(copy_to_user((char *)arg,dev->dev_msg,MESSAGE_LEN)) {
+			kv.val[MESSAGE_LEN - 1] = '\0';
+			retval = fourmb_meta_update(dev, &kv, false);
+			if(retval)
+				return retval;
+			kv.old[MESSAGE_LEN - 1] = '\0';
+			if(copy_to_user((char *)arg,kv.old,MESSAGE_LEN)) {
 				printk(KERN_ERR "fourmb_device: ioctl failed to swap the device name\n");
 				return -ENOTTY;
 			}
-			printk(KERN_INFO "fourmb_device: ioctl successfuly swapped the device name\n");
-			strcpy(dev->dev_msg,tmp_msg);
-			printk(KERN_INFO "fourmb_device: ioctl new device name after swap %s\n",dev->dev_msg);
 			break;
 
+		case FOURMB_IOC_MGET:
+			retval = fourmb_meta_copy_kv(&kv, (void __user *)arg);
+			if(retval)
+				return retval;
+			retval = fourmb_meta_get(dev, kv.key, kv.val);
+			if(retval)
+				return retval;
+			if(copy_to_user((void __user *)arg, &kv, sizeof(kv)))
+				return -EFAULT;
+			break;
+
+		case FOURMB_IOC_MPUT:
+		case FOURMB_IOC_MCAS:
+			retval = fourmb_meta_copy_kv(&kv, (void __user *)arg);
+			if(retval)
+				return retval;
+			retval = fourmb_meta_update(dev, &kv, cmd == FOURMB_IOC_MCAS);
+			if(cmd == FOURMB_IOC_MCAS && (!retval || retval == -EAGAIN) &&
+					copy_to_user(((struct fourmb_meta_kv __user *)arg)->old, kv.old, FOURMB_META_VALLEN))
+				return -EFAULT;
+			return retval;
+
+		case FOURMB_IOC_MBATCH:
+			if(copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+				return -EFAULT;
+			if(batch.count == 0 || batch.count > FOURMB_META_BATCH_MAX)
+				return -EINVAL;
+			kvs = kmalloc_array(batch.count, sizeof(*kvs), GFP_KERNEL);
+			if(!kvs)
+				return -ENOMEM;
+			retval = 0;
+			for(i = 0; i < batch.count && !retval; i++)
+				retval = fourmb_meta_copy_kv(&kvs[i],
+						(struct fourmb_meta_kv __user *)(unsigned long)batch.kvs + i);
+			if(!retval)
+				retval = fourmb_meta_update_batch(dev, kvs, batch.count);
+			kfree(kvs);
+			return retval;
+
+		case FOURMB_IOC_WCOMBINE:
+			return fourmb_wc_set(filep->private_data, arg != 0);
+
 		default:
 			return -ENOTTY;
 	}
+	return 0;
+}
+
+/* sum of a per cpu counter, 0 until it is set up */
+static unsigned long fourmb_stat_read(unsigned long __percpu *ctr) {
+	unsigned long sum = 0;
+	int cpu;
+
+	if(!ctr)
+		return 0;
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(ctr, cpu);
+	return sum;
+}
+
+static int fourmb_stats_show(struct seq_file *m, void *v) {
+	struct fourmb_stats *st = &fourmb_device->stats;
+	long completed = atomic_long_read(&st->aio_completed);
+
+	seq_printf(m, "size             %lu\n", READ_ONCE(fourmb_device->size));
+	seq_printf(m, "append_tail      %ld\n", atomic_long_read(&fourmb_device->append_tail));
+	seq_printf(m, "aio_inflight     %ld\n", atomic_long_read(&st->aio_inflight));
+	seq_printf(m, "aio_submitted    %ld\n", atomic_long_read(&st->aio_submitted));
+	seq_printf(m, "aio_completed    %ld\n", completed);
+	seq_printf(m, "aio_lat_avg_ns   %llu\n",
+			completed ? div_u64(atomic64_read(&st->aio_lat_ns), completed) : 0);
+	seq_printf(m, "aio_lat_max_ns   %lld\n", atomic64_read(&st->aio_lat_max_ns));
+	if(fourmb_device->shmem) {
+		seq_printf(m, "capacity         %lu\n", fourmb_device->capacity);
+		seq_printf(m, "pcache_pages     %u\n", fourmb_device->pcache_nr);
+		seq_printf(m, "pcache_hits      %lu\n", fourmb_stat_read(st->pcache_hits));
+		seq_printf(m, "pcache_misses    %lu\n", fourmb_stat_read(st->pcache_misses));
+	}
+	if(fourmb_device->crc) {
+		seq_printf(m, "crc_verified     %lu\n", fourmb_stat_read(st->crc_verified));
+		seq_printf(m, "crc_mismatch     %ld\n", atomic_long_read(&st->crc_mismatch));
+		seq_printf(m, "scrub_passes     %ld\n", atomic_long_read(&st->scrub_passes));
+		seq_printf(m, "scrub_mismatch   %ld\n", atomic_long_read(&st->scrub_mismatch));
+	}
+	if(fourmb_device->trace.ring) {
+		seq_printf(m, "trace_records    %lu\n", fourmb_device->trace.mask + 1);
+		seq_printf(m, "trace_lost       %ld\n", atomic_long_read(&fourmb_device->trace.lost));
+	}
+	if(atomic_long_read(&st->wc_staged)) {
+		seq_printf(m, "wc_staged        %ld\n", atomic_long_read(&st->wc_staged));
+		seq_printf(m, "wc_flushes       %ld\n", atomic_long_read(&st->wc_flushes));
+	}
+	return 0;
 }
 
-static int __exit fourmb_device_exit(void) {
+/* undoes whatever fourmb_device_init() got through */
+static void fourmb_device_teardown(void) {
 	dev_t dev_num = MKDEV(fourmb_major,fourmb_minor);
 
+	proc_remove(fourmb_proc);
+	proc_remove(fourmb_trace_proc);
 	/* Get rid of our char dev entries */
+	if(fourmb_device && fourmb_device->cdev.ops) {
+		cdev_del(&fourmb_device->cdev);
+	}
+	/* waits for queued async I/O */
+	if(fourmb_aio_wq) {
+		destroy_workqueue(fourmb_aio_wq);
+		fourmb_aio_wq = NULL;
+	}
+	if(fourmb_device && fourmb_device->scrub_task) {
+		kthread_stop(fourmb_device->scrub_task);
+		fourmb_device->scrub_task = NULL;
+	}
 	if(fourmb_device) {
 		fourmb_device_clean(fourmb_device);
+		fourmb_crc_release(fourmb_device);
+		fourmb_shmem_release(fourmb_device);
+		fourmb_meta_clean(fourmb_device);
+		fourmb_trace_release(fourmb_device);
 		kfree(fourmb_device);
+		fourmb_device = NULL;
 	}
 	unregister_chrdev_region(dev_num,1);
+}
+
+static void __exit fourmb_device_exit(void) {
+	fourmb_device_teardown();
 	printk(KERN_INFO "fourmb_device: Device removed successfully\n");
-	return 0;
+}
+
+/* drops the references held by the page cache slots */
+static void fourmb_pcache_drop(struct fourmb_dev* dev) {
+	unsigned int i;
+
+	for(i = 0; i < dev->pcache_nr; i++) {
+		if(dev->pcache[i].page) {
+			put_page(dev->pcache[i].page);
+			dev->pcache[i].page = NULL;
+		}
+	}
 }
 
 int fourmb_device_clean(struct fourmb_dev* dev) {
 	struct fourmb_ll *itr, *next;
+	int i;
+
+	if(dev->shmem) {
+		fourmb_pcache_drop(dev);
+		shmem_truncate_range(file_inode(dev->shmem), 0, (loff_t)-1);
+	}
+	if(dev->crc) {
+		memset32(dev->crc, dev->crc_zero, dev->nr_sets);
+	}
 	for(itr = dev->buf_list; itr; itr = next) {
 		if(itr->data) {
 			kfree(itr->data);
@@ -380,10 +1872,277 @@ int fourmb_device_clean(struct fourmb_dev* dev) {
 		kfree(itr);
 	}
 	dev->buf_list = NULL;
+	kvfree(dev->set_index);
+	dev->set_index = NULL;
 	dev->size = 0;
+	atomic_long_set(&dev->append_tail, 0);
+	WRITE_ONCE(dev->append_gen, dev->append_gen + 1);
+	/* waiters may have seen the new size before the new gen */
+	smp_mb();
+	for(i = 0; i < ARRAY_SIZE(dev->append_wait); i++)
+		wake_up_var(&dev->append_wait[i]);
+	return 0;
+}
+
+void fourmb_dev_init(struct fourmb_dev* dev) {
+	int i;
+
+	dev->capacity = DEV_SIZE;
+	for(i = 0; i < FOURMB_CRC_LOCKS; i++)
+		mutex_init(&dev->crc_locks[i]);
+	init_rwsem(&dev->sem);
+	mutex_init(&dev->alloc_lock);
+	fourmb_meta_init(dev);
+	fourmb_meta_put(dev,FOURMB_META_NAME,"anonymous");
+}
+
+
+/* switches an empty device to capacity bytes of shmem */
+int fourmb_shmem_setup(struct fourmb_dev* dev, unsigned long capacity, unsigned int nr_cache) {
+	struct file* file;
+	unsigned int i;
+
+	capacity = round_up(capacity, PAGE_SIZE);
+	file = shmem_file_setup("fourmb_device", capacity, VM_NORESERVE);
+	if(IS_ERR(file)) {
+		printk(KERN_ERR "fourmb_device: Unable to set up the shmem backing\n");
+		return PTR_ERR(file);
+	}
+	dev->stats.pcache_hits = alloc_percpu(unsigned long);
+	dev->stats.pcache_misses = alloc_percpu(unsigned long);
+	if(nr_cache)
+		dev->pcache = kvcalloc(nr_cache, sizeof(*dev->pcache), GFP_KERNEL);
+	if(!dev->stats.pcache_hits || !dev->stats.pcache_misses || (nr_cache && !dev->pcache)) {
+		dev->shmem = file;
+		fourmb_shmem_release(dev);
+		return -ENOMEM;
+	}
+	for(i = 0; i < nr_cache; i++)
+		spin_lock_init(&dev->pcache[i].lock);
+	dev->pcache_nr = nr_cache;
+	dev->shmem = file;
+	dev->capacity = capacity;
 	return 0;
 }
 
+void fourmb_shmem_release(struct fourmb_dev* dev) {
+	if(!dev->shmem)
+		return;
+	fourmb_pcache_drop(dev);
+	kvfree(dev->pcache);
+	dev->pcache = NULL;
+	dev->pcache_nr = 0;
+	free_percpu(dev->stats.pcache_hits);
+	dev->stats.pcache_hits = NULL;
+	free_percpu(dev->stats.pcache_misses);
+	dev->stats.pcache_misses = NULL;
+	fput(dev->shmem);
+	dev->shmem = NULL;
+	dev->capacity = DEV_SIZE;
+}
+
+/* turns crc mode on, after any fourmb_shmem_setup() */
+int fourmb_crc_setup(struct fourmb_dev* dev) {
+	unsigned int z;
+
+	dev->nr_sets = dev->capacity / SET_SIZE;
+	dev->crc = kvmalloc_array(dev->nr_sets, sizeof(*dev->crc), GFP_KERNEL);
+	dev->crc_bounce = kvmalloc_array(FOURMB_CRC_LOCKS, SET_SIZE, GFP_KERNEL);
+	dev->stats.crc_verified = alloc_percpu(unsigned long);
+	if(!dev->crc || !dev->crc_bounce || !dev->stats.crc_verified) {
+		printk(KERN_ERR "fourmb_device: Unable to allocate the CRC table\n");
+		fourmb_crc_release(dev);
+		return -ENOMEM;
+	}
+	/* x^0, then one x^8 per zero byte */
+	fourmb_crc_shift[0] = 1U << 31;
+	for(z = 1; z <= SET_SIZE; z++)
+		fourmb_crc_shift[z] = fourmb_crc_mult(1U << 23, fourmb_crc_shift[z - 1]);
+
+	dev->crc_zero = crc32c(~0, page_address(ZERO_PAGE(0)), SET_SIZE);
+	/* every set starts out as zeroes */
+	memset32(dev->crc, dev->crc_zero, dev->nr_sets);
+	return 0;
+}
+
+void fourmb_crc_release(struct fourmb_dev* dev) {
+	kvfree(dev->crc);
+	dev->crc = NULL;
+	kvfree(dev->crc_bounce);
+	dev->crc_bounce = NULL;
+	free_percpu(dev->stats.crc_verified);
+	dev->stats.crc_verified = NULL;
+	dev->nr_sets = 0;
+}
+
+/* turns capture on, nr is rounded up to a power of two */
+int fourmb_trace_setup(struct fourmb_dev* dev, unsigned int nr) {
+	struct fourmb_trace *trace = &dev->trace;
+
+	nr = roundup_pow_of_two(max(nr, 2U));
+	trace->ring = vzalloc(array_size(nr, sizeof(*trace->ring)));
+	if(!trace->ring) {
+		printk(KERN_ERR "fourmb_device: Unable to allocate the trace ring\n");
+		return -ENOMEM;
+	}
+	trace->mask = nr - 1;
+	atomic_long_set(&trace->head, 0);
+	trace->tail = 0;
+	atomic_long_set(&trace->lost, 0);
+	mutex_init(&trace->drain_lock);
+	return 0;
+}
+
+/* only once nothing can call the fops any more */
+void fourmb_trace_release(struct fourmb_dev* dev) {
+	vfree(dev->trace.ring);
+	dev->trace.ring = NULL;
+}
+
+static void __fourmb_trace(struct fourmb_trace *trace, u16 op, u16 flags, u64 off, u32 len) {
+	struct fourmb_trace_rec *rec;
+	unsigned long head;
+
+	head = atomic_long_read(&trace->head);
+	do {
+		/* pairs with the release of tail in fourmb_trace_drain() */
+		if(head - smp_load_acquire(&trace->tail) > trace->mask) {
+			atomic_long_inc(&trace->lost);
+			return;
+		}
+	} while(!atomic_long_try_cmpxchg(&trace->head, (long *)&head, head + 1));
+
+	rec = &trace->ring[head & trace->mask];
+	rec->ts_ns = ktime_get_ns();
+	rec->off = off;
+	rec->len = len;
+	rec->pid = task_pid_nr(current);
+	rec->flags = flags;
+	rec->cpu = raw_smp_processor_id();
+	smp_store_release(&rec->op, op);
+}
+
+/*
+ * Copies out whole committed records, oldest
+ * first, and frees their slots. Returns 0 when
+ * there is nothing to drain, never blocks.
+ */
+static ssize_t fourmb_trace_drain(struct fourmb_trace *trace, char __user *buf, size_t count) {
+	struct fourmb_trace_rec *slot, rec;
+	size_t done = 0;
+	ssize_t retval = 0;
+
+	if(count < sizeof(rec))
+		return -EINVAL;
+	mutex_lock(&trace->drain_lock);
+	while(done + sizeof(rec) <= count) {
+		slot = &trace->ring[trace->tail & trace->mask];
+		rec.op = smp_load_acquire(&slot->op);
+		if(!rec.op)
+			break;
+		rec.ts_ns = slot->ts_ns;
+		rec.off = slot->off;
+		rec.len = slot->len;
+		rec.pid = slot->pid;
+		rec.flags = slot->flags;
+		rec.cpu = slot->cpu;
+		if(copy_to_user(buf + done, &rec, sizeof(rec))) {
+			retval = -EFAULT;
+			break;
+		}
+		WRITE_ONCE(slot->op, 0);
+		smp_store_release(&trace->tail, trace->tail + 1);
+		done += sizeof(rec);
+	}
+	mutex_unlock(&trace->drain_lock);
+	return done ? done : retval;
+}
+
+static ssize_t fourmb_trace_read(struct file *filep, char __user *buf, size_t count, loff_t *f_pos) {
+	return fourmb_trace_drain(&fourmb_device->trace, buf, count);
+}
+
+static const struct proc_ops fourmb_trace_fops = {
+	.proc_read		= fourmb_trace_read,
+	.proc_lseek		= noop_llseek,
+};
+
+/*
+ * fourmb_set_get() for the scrubber. A shmem
+ * set is only checked while its page is
+ * resident: swapping cold pages back in and
+ * evicting the page cache slots for them
+ * would undo what shmem backing is for. NULL
+ * means skip the set.
+ */
+static void *fourmb_scrub_get(struct fourmb_dev *dev, unsigned long idx, struct page **pagep) {
+	unsigned long off = idx * SET_SIZE;
+	struct folio *folio;
+	struct page *page;
+
+	if(!dev->shmem)
+		return fourmb_set_get(dev, idx, false, pagep);
+
+	*pagep = NULL;
+	folio = filemap_get_folio(dev->shmem->f_mapping, off >> PAGE_SHIFT);
+	if(IS_ERR(folio))
+		return NULL;
+	if(!folio_test_uptodate(folio)) {
+		folio_put(folio);
+		return NULL;
+	}
+	page = folio_file_page(folio, off >> PAGE_SHIFT);
+	*pagep = page;
+	return kmap_local_page(page) + offset_in_page(off);
+}
+
+/*
+ * One scrub of every set below dev->size,
+ * returns the mismatches found. The sem is
+ * dropped between sets so writers and
+ * fourmb_device_clean() are not held up.
+ */
+unsigned long fourmb_scrub_pass(struct fourmb_dev* dev, bool from_thread) {
+	unsigned long idx, bad = 0;
+	struct page* page;
+	void* data;
+
+	for(idx = 0; idx < dev->nr_sets; idx++) {
+		if(from_thread && kthread_should_stop())
+			break;
+		down_read(&dev->sem);
+		if(idx * SET_SIZE >= READ_ONCE(dev->size)) {
+			up_read(&dev->sem);
+			break;
+		}
+		data = fourmb_scrub_get(dev,idx,&page);
+		if(!IS_ERR_OR_NULL(data)) {
+			fourmb_crc_lock(dev,idx);
+			if(!fourmb_crc_check(dev,idx,data)) {
+				printk_ratelimited(KERN_ERR "fourmb_device: scrub found a CRC mismatch in set %lu\n",idx);
+				bad++;
+			}
+			fourmb_crc_unlock(dev,idx);
+			fourmb_set_put(data,page,false);
+		}
+		up_read(&dev->sem);
+		cond_resched();
+	}
+	atomic_long_inc(&dev->stats.scrub_passes);
+	atomic_long_add(bad, &dev->stats.scrub_mismatch);
+	return bad;
+}
+
+static int fourmb_scrub_thread(void* arg) {
+	struct fourmb_dev* dev = arg;
+
+	set_user_nice(current, MAX_NICE);
+	while(!kthread_should_stop()) {
+		fourmb_scrub_pass(dev,true);
+		schedule_timeout_interruptible(msecs_to_jiffies(scrub_interval_ms));
+	}
+	return 0;
+}
 
 /* LKM init modules */
 static int __init fourmb_device_init(void) {
@@ -399,8 +2158,41 @@ static int __init fourmb_device_init(void) {
 	}
 	memset(fourmb_device,0,sizeof(struct fourmb_dev));
 
+	/* per-CPU workers for async I/O */
+	fourmb_aio_wq = alloc_workqueue("fourmb_aio", 0, 0);
+	if(!fourmb_aio_wq) {
+		printk(KERN_ERR "fourmb_device: Unable to create the aio workqueue\n");
+		retval = -ENOMEM;
+		goto fail;
+	}
+
 	/* Device Initialization */
-	strcpy(fourmb_device->dev_msg,"anonymous");
+	fourmb_dev_init(fourmb_device);
+	if(shmem_mb) {
+		retval = fourmb_shmem_setup(fourmb_device,shmem_mb << 20,cache_pages);
+		if(retval)
+			goto fail;
+	}
+	if(crc) {
+		retval = fourmb_crc_setup(fourmb_device);
+		if(retval)
+			goto fail;
+		if(scrub_interval_ms) {
+			fourmb_device->scrub_task = kthread_run(fourmb_scrub_thread,fourmb_device,"fourmb_scrub");
+			if(IS_ERR(fourmb_device->scrub_task)) {
+				retval = PTR_ERR(fourmb_device->scrub_task);
+				fourmb_device->scrub_task = NULL;
+				goto fail;
+			}
+		}
+	}
+	if(trace_records) {
+		retval = fourmb_trace_setup(fourmb_device,trace_records);
+		if(retval)
+			goto fail;
+		fourmb_trace_proc = proc_create("fourmb_trace", 0400, NULL, &fourmb_trace_fops);
+	}
+	fourmb_proc = proc_create_single("fourmb_device", 0444, NULL, fourmb_stats_show);
 	cdev_init(&(fourmb_device->cdev),&fourmb_fops);
 	fourmb_device->cdev.owner = THIS_MODULE;
 	fourmb_device->cdev.ops	  = &fourmb_fops;
@@ -412,10 +2204,14 @@ static int __init fourmb_device_init(void) {
 	printk(KERN_INFO "fourmb_device: Device initialized and registered successfully\n");
 	return 0;
 	fail:
-		fourmb_device_exit();
+		fourmb_device_teardown();
 		return retval;
 }
 
+#ifdef FOURMB_KUNIT_TEST
+#include "fourmb_device_driver_test.c"
+#endif
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Arka Maity");
 MODULE_DESCRIPTION("First Device Driver: 24.03.2017");
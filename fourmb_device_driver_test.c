@@ -0,0 +1,1166 @@
+/*
+ * KUnit suite for the 4MB device
+ * ------------------------------
+ *
+ * This file is not built on its own, it is
+ * pulled into fourmb_device_driver.c when the
+ * module is built with `make FOURMB_KUNIT=1`
+ * so that the tests can reach the driver
+ * internals. Load the resulting module into a
+ * KUnit enabled kernel (UML or qemu, see
+ * README.md), results come out as KTAP.
+ *
+ * The fops take __user pointers, so every test
+ * maps a scratch page into the current mm with
+ * kunit_vm_mmap() (needs 6.10+).
+ */
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/mman.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+
+#define FOURMB_TEST_BUF		(2 * PAGE_SIZE)
+#define FOURMB_BENCH_ITERS	10000
+
+struct fourmb_test_ctx {
+	struct fourmb_dev dev;
+	struct fourmb_file file;	/* filp's, until a test calls fourmb_open() */
+	struct file filp;
+	char __user *ubuf;	/* FOURMB_TEST_BUF bytes of user memory */
+};
+
+static int fourmb_test_init(struct kunit *test) {
+	struct fourmb_test_ctx *ctx;
+	unsigned long uaddr;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+
+	uaddr = kunit_vm_mmap(test, NULL, 0, FOURMB_TEST_BUF,
+			PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+	if (IS_ERR_VALUE(uaddr))
+		kunit_skip(test, "kunit_vm_mmap failed, no user memory available");
+	ctx->ubuf = (char __user *)uaddr;
+
+	fourmb_dev_init(&ctx->dev);
+	ctx->file.dev = &ctx->dev;
+	mutex_init(&ctx->file.wc_lock);
+	ctx->filp.private_data = &ctx->file;
+	ctx->filp.f_flags = O_RDWR;
+	test->priv = ctx;
+	return 0;
+}
+
+static void fourmb_test_exit(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+
+	if (ctx) {
+		if (ctx->filp.private_data != &ctx->file)
+			fourmb_release(NULL, &ctx->filp);
+		kfree(ctx->file.wc_buf);
+		fourmb_device_clean(&ctx->dev);
+		fourmb_crc_release(&ctx->dev);
+		fourmb_shmem_release(&ctx->dev);
+		fourmb_meta_clean(&ctx->dev);
+		fourmb_trace_release(&ctx->dev);
+	}
+}
+
+/* fill the user buffer with @c and write @count bytes at @pos */
+static ssize_t fourmb_test_write(struct kunit *test, loff_t pos, char c, size_t count) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	char *tmp;
+
+	tmp = kunit_kmalloc(test, count, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, tmp);
+	memset(tmp, c, count);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ctx->ubuf, tmp, count), 0);
+
+	ctx->filp.f_pos = pos;
+	return fourmb_write(&ctx->filp, ctx->ubuf, count, &ctx->filp.f_pos);
+}
+
+/*
+ * Set allocation
+ */
+static void fourmb_test_set_alloc(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct fourmb_ll *ll, *itr;
+	int n = 0;
+
+	KUNIT_EXPECT_NULL(test, ctx->dev.buf_list);
+
+	/* lookups without create leave the list alone */
+	KUNIT_EXPECT_NULL(test, fourmb_ll_lookup(&ctx->dev, 3, false));
+	KUNIT_EXPECT_NULL(test, ctx->dev.buf_list);
+
+	ll = compute_dev_idx_ptr(&ctx->dev, 0);
+	KUNIT_ASSERT_NOT_NULL(test, ll);
+	KUNIT_EXPECT_PTR_EQ(test, ll, ctx->dev.buf_list);
+	KUNIT_EXPECT_NULL(test, ll->data);	/* nodes only, data comes with writes */
+
+	ll = compute_dev_idx_ptr(&ctx->dev, 3);
+	KUNIT_ASSERT_NOT_NULL(test, ll);
+	for (itr = ctx->dev.buf_list; itr; itr = itr->next)
+		n++;
+	KUNIT_EXPECT_EQ(test, n, 4);
+
+	/* looking up again must not grow the list */
+	KUNIT_EXPECT_PTR_EQ(test, compute_dev_idx_ptr(&ctx->dev, 3), ll);
+	KUNIT_EXPECT_NOT_NULL(test, compute_dev_idx_ptr(&ctx->dev, NUM_SETS - 1));
+	KUNIT_EXPECT_NULL(test, compute_dev_idx_ptr(&ctx->dev, NUM_SETS));
+	KUNIT_EXPECT_PTR_EQ(test, fourmb_ll_lookup(&ctx->dev, 3, false), ll);
+
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, SET_SIZE * 3 + 7, 'a', 1), 1);
+	KUNIT_EXPECT_NOT_NULL(test, ll->data);
+	KUNIT_EXPECT_EQ(test, ((char *)ll->data)[7], 'a');
+	KUNIT_EXPECT_EQ(test, ((char *)ll->data)[6], 0);
+}
+
+/*
+ * Cross-set boundaries : a single call never
+ * spans two sets, the caller loops.
+ */
+static void fourmb_test_set_boundary(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	char out[10];
+
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, SET_SIZE - 2, 'x', 10), 2);
+	KUNIT_EXPECT_EQ(test, ctx->filp.f_pos, (loff_t)SET_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, SET_SIZE, 'y', 8), 8);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, (unsigned long)SET_SIZE + 8);
+
+	ctx->filp.f_pos = SET_SIZE - 2;
+	KUNIT_EXPECT_EQ(test, fourmb_read(&ctx->filp, ctx->ubuf, 10, &ctx->filp.f_pos), 2);
+	KUNIT_EXPECT_EQ(test, fourmb_read(&ctx->filp, ctx->ubuf + 2, 8, &ctx->filp.f_pos), 8);
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ctx->ubuf, sizeof(out)), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "xxyyyyyyyy", sizeof(out));
+
+	/* the last byte of the device and nothing past it */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, DEV_SIZE - 1, 'z', 4), 1);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, (unsigned long)DEV_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, DEV_SIZE, 'z', 1), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, DEV_SIZE + 1, 'z', 1), 0);
+}
+
+/*
+ * lseek whence modes
+ */
+static void fourmb_test_lseek(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, '1', 10), 10);
+
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, 0, SEEK_SET), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, 4, SEEK_CUR), 4);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, 4, SEEK_CUR), 8);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, -2, SEEK_CUR), 6);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, 0, SEEK_END), 10);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, -4, SEEK_END), 6);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, 100, SEEK_END), 110);
+
+	/* failures leave f_pos untouched */
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, -11, SEEK_END), -EINVAL);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, -1, SEEK_SET), -EINVAL);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, -4, -1), -EINVAL);
+	KUNIT_EXPECT_EQ(test, filp->f_pos, 110);
+}
+
+/*
+ * Size accounting, mirrors lseek_test.c
+ */
+static void fourmb_test_size(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	struct inode *inode;
+
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, '1', 1), 1);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 1UL);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 1, '1', 9), 9);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 10UL);
+
+	/* overwriting inside the data does not grow it */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 2, '2', 3), 3);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 10UL);
+
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 14, '2', 3), 3);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 17UL);
+
+	/* reads are trimmed to size and do not modify it */
+	filp->f_pos = 12;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 100, &filp->f_pos), 5);
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 100, &filp->f_pos), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 17UL);
+
+	/* a read write open keeps the data, a write only one truncates it */
+	inode = kunit_kzalloc(test, sizeof(*inode), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, inode);
+	inode->i_cdev = &ctx->dev.cdev;
+	KUNIT_EXPECT_EQ(test, fourmb_open(inode, filp), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 17UL);
+	KUNIT_EXPECT_EQ(test, fourmb_release(inode, filp), 0);
+	filp->f_flags = O_WRONLY;
+	KUNIT_EXPECT_EQ(test, fourmb_open(inode, filp), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 0UL);
+	KUNIT_EXPECT_NULL(test, ctx->dev.buf_list);
+}
+
+/*
+ * ioctl commands, mirrors ioctl_test.c
+ */
+static void fourmb_test_ioctl(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	unsigned long arg = (unsigned long)ctx->ubuf;
+	char msg[MESSAGE_LEN], val[FOURMB_META_VALLEN];
+
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_HELLO, 0), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(filp, _IO('j', 1), 0), -ENOTTY);
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(filp, _IO(FOURMB_IOC_MAGIC, FOURMB_IOC_MAXNR + 1), 0), -ENOTTY);
+
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_LDM, arg), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(msg, ctx->ubuf, MESSAGE_LEN), 0);
+	KUNIT_EXPECT_STREQ(test, msg, "anonymous");
+
+	memset(msg, 0, sizeof(msg));
+	strcpy(msg, "lkncvn");
+	KUNIT_ASSERT_EQ(test, copy_to_user(ctx->ubuf, msg, MESSAGE_LEN), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_STM, arg), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_meta_get(&ctx->dev, FOURMB_META_NAME, val), 0);
+	KUNIT_EXPECT_STREQ(test, val, "lkncvn");
+
+	memset(msg, 0, sizeof(msg));
+	strcpy(msg, "jkfvfvb");
+	KUNIT_ASSERT_EQ(test, copy_to_user(ctx->ubuf, msg, MESSAGE_LEN), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_LDSTM, arg), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(msg, ctx->ubuf, MESSAGE_LEN), 0);
+	KUNIT_EXPECT_STREQ(test, msg, "lkncvn");
+	KUNIT_EXPECT_EQ(test, fourmb_meta_get(&ctx->dev, FOURMB_META_NAME, val), 0);
+	KUNIT_EXPECT_STREQ(test, val, "jkfvfvb");
+
+	/* a kernel address must be refused */
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_LDM, (unsigned long)msg), -EFAULT);
+}
+
+/* runs a metadata ioctl on @kv through the user buffer, @kv gets the result */
+static long fourmb_test_meta_ioctl(struct kunit *test, unsigned int cmd, struct fourmb_meta_kv *kv) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	long retval;
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(ctx->ubuf, kv, sizeof(*kv)), 0);
+	retval = fourmb_ioctl(&ctx->filp, cmd, (unsigned long)ctx->ubuf);
+	KUNIT_ASSERT_EQ(test, copy_from_user(kv, ctx->ubuf, sizeof(*kv)), 0);
+	return retval;
+}
+
+/*
+ * Metadata store ioctls
+ */
+static void fourmb_test_meta(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct fourmb_meta_kv kv = { .key = "region0" }, *kvs;
+	struct fourmb_meta_batch batch;
+	char val[FOURMB_META_VALLEN];
+	int i;
+
+	KUNIT_EXPECT_EQ(test, fourmb_test_meta_ioctl(test, FOURMB_IOC_MGET, &kv), -ENOENT);
+
+	strcpy(kv.val, "hot");
+	KUNIT_EXPECT_EQ(test, fourmb_test_meta_ioctl(test, FOURMB_IOC_MPUT, &kv), 0);
+	memset(kv.val, 0, sizeof(kv.val));
+	KUNIT_EXPECT_EQ(test, fourmb_test_meta_ioctl(test, FOURMB_IOC_MGET, &kv), 0);
+	KUNIT_EXPECT_STREQ(test, kv.val, "hot");
+
+	/* cas with a stale old value fails and reports the current one */
+	strcpy(kv.val, "cold");
+	strcpy(kv.old, "warm");
+	KUNIT_EXPECT_EQ(test, fourmb_test_meta_ioctl(test, FOURMB_IOC_MCAS, &kv), -EAGAIN);
+	KUNIT_EXPECT_STREQ(test, kv.old, "hot");
+	KUNIT_EXPECT_EQ(test, fourmb_test_meta_ioctl(test, FOURMB_IOC_MCAS, &kv), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_meta_get(&ctx->dev, "region0", val), 0);
+	KUNIT_EXPECT_STREQ(test, val, "cold");
+
+	/* cas against "" only inserts */
+	strcpy(kv.key, "region1");
+	strcpy(kv.val, "new");
+	kv.old[0] = '\0';
+	KUNIT_EXPECT_EQ(test, fourmb_test_meta_ioctl(test, FOURMB_IOC_MCAS, &kv), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_test_meta_ioctl(test, FOURMB_IOC_MCAS, &kv), -EAGAIN);
+
+	/* an empty value deletes */
+	kv.val[0] = '\0';
+	KUNIT_EXPECT_EQ(test, fourmb_test_meta_ioctl(test, FOURMB_IOC_MPUT, &kv), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_meta_get(&ctx->dev, "region1", val), -ENOENT);
+	KUNIT_EXPECT_EQ(test, ctx->dev.meta_count, 2U);
+
+	kv.key[0] = '\0';
+	KUNIT_EXPECT_EQ(test, fourmb_test_meta_ioctl(test, FOURMB_IOC_MPUT, &kv), -EINVAL);
+
+	/* batch, the kv array sits after the batch header in the user buffer */
+	kvs = kunit_kzalloc(test, FOURMB_META_BATCH_MAX * sizeof(*kvs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, kvs);
+	KUNIT_ASSERT_LE(test, sizeof(batch) + 4 * sizeof(*kvs), (size_t)FOURMB_TEST_BUF);
+	for (i = 0; i < 4; i++) {
+		snprintf(kvs[i].key, FOURMB_META_KEYLEN, "set%d", i);
+		snprintf(kvs[i].val, FOURMB_META_VALLEN, "owner%d", i);
+	}
+	batch.count = 4;
+	batch.pad = 0;
+	batch.kvs = (unsigned long)(ctx->ubuf + sizeof(batch));
+	KUNIT_ASSERT_EQ(test, copy_to_user(ctx->ubuf, &batch, sizeof(batch)), 0);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ctx->ubuf + sizeof(batch), kvs, 4 * sizeof(*kvs)), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(&ctx->filp, FOURMB_IOC_MBATCH, (unsigned long)ctx->ubuf), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_meta_get(&ctx->dev, "set3", val), 0);
+	KUNIT_EXPECT_STREQ(test, val, "owner3");
+	KUNIT_EXPECT_EQ(test, ctx->dev.meta_count, 6U);
+
+	batch.count = FOURMB_META_BATCH_MAX + 1;
+	KUNIT_ASSERT_EQ(test, copy_to_user(ctx->ubuf, &batch, sizeof(batch)), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(&ctx->filp, FOURMB_IOC_MBATCH, (unsigned long)ctx->ubuf), -EINVAL);
+}
+
+/*
+ * read_iter/write_iter, synchronous : one
+ * call spans sets, holes read as zeroes.
+ */
+static void fourmb_test_iter_sync(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct iov_iter iter;
+	struct kiocb iocb;
+	char *buf;
+
+	buf = kunit_kmalloc(test, 3 * SET_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	memset(buf, 'i', 3 * SET_SIZE);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ctx->ubuf, buf, 3 * SET_SIZE), 0);
+
+	init_sync_kiocb(&iocb, &ctx->filp);
+	iocb.ki_pos = SET_SIZE - 10;
+	iov_iter_ubuf(&iter, ITER_SOURCE, ctx->ubuf, 2 * SET_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_write_iter(&iocb, &iter), (ssize_t)(2 * SET_SIZE));
+	KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)(3 * SET_SIZE - 10));
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, (unsigned long)(3 * SET_SIZE - 10));
+
+	/* set 0 was never written and reads back as zeroes */
+	iocb.ki_pos = 0;
+	iov_iter_ubuf(&iter, ITER_DEST, ctx->ubuf, 4 * SET_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_read_iter(&iocb, &iter), (ssize_t)(3 * SET_SIZE - 10));
+	KUNIT_ASSERT_EQ(test, copy_from_user(buf, ctx->ubuf, 3 * SET_SIZE - 10), 0);
+	KUNIT_EXPECT_EQ(test, buf[SET_SIZE - 11], 0);
+	KUNIT_EXPECT_EQ(test, buf[SET_SIZE - 10], 'i');
+	KUNIT_EXPECT_EQ(test, buf[3 * SET_SIZE - 11], 'i');
+
+	/* at the end of the data */
+	iov_iter_ubuf(&iter, ITER_DEST, ctx->ubuf, SET_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_read_iter(&iocb, &iter), 0);
+}
+
+struct fourmb_test_aio {
+	struct kiocb iocb;
+	struct completion done;
+	long res;
+};
+
+static void fourmb_test_ki_complete(struct kiocb *iocb, long res) {
+	struct fourmb_test_aio *t = container_of(iocb, struct fourmb_test_aio, iocb);
+
+	t->res = res;
+	complete(&t->done);
+}
+
+/*
+ * read_iter/write_iter, asynchronous : split
+ * into chunks on the workqueue, completed
+ * through ki_complete.
+ */
+static void fourmb_test_iter_async(struct kunit *test) {
+	const size_t len = 3 * FOURMB_AIO_CHUNK_SETS * SET_SIZE;
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct fourmb_test_aio t;
+	struct iov_iter iter;
+	unsigned long uaddr;
+	char *buf;
+	int i;
+
+	if (!fourmb_aio_wq)
+		kunit_skip(test, "module workqueue not set up");
+
+	uaddr = kunit_vm_mmap(test, NULL, 0, 2 * len, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, 0);
+	KUNIT_ASSERT_FALSE(test, IS_ERR_VALUE(uaddr));
+	buf = kunit_kmalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	for (i = 0; i < len; i++)
+		buf[i] = i % 251;
+	KUNIT_ASSERT_EQ(test, copy_to_user((char __user *)uaddr, buf, len), 0);
+
+	/* unaligned, so the first and last chunks are partial */
+	init_sync_kiocb(&t.iocb, &ctx->filp);
+	t.iocb.ki_complete = fourmb_test_ki_complete;
+	t.iocb.ki_pos = 100;
+	init_completion(&t.done);
+	iov_iter_ubuf(&iter, ITER_SOURCE, (char __user *)uaddr, len);
+	KUNIT_ASSERT_EQ(test, fourmb_write_iter(&t.iocb, &iter), (ssize_t)-EIOCBQUEUED);
+	wait_for_completion(&t.done);
+	KUNIT_EXPECT_EQ(test, t.res, (long)len);
+	KUNIT_EXPECT_EQ(test, t.iocb.ki_pos, (loff_t)(100 + len));
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, (unsigned long)(100 + len));
+
+	t.iocb.ki_pos = 100;
+	reinit_completion(&t.done);
+	iov_iter_ubuf(&iter, ITER_DEST, (char __user *)uaddr + len, len);
+	KUNIT_ASSERT_EQ(test, fourmb_read_iter(&t.iocb, &iter), (ssize_t)-EIOCBQUEUED);
+	wait_for_completion(&t.done);
+	KUNIT_EXPECT_EQ(test, t.res, (long)len);
+	memset(buf, 0, len);
+	KUNIT_ASSERT_EQ(test, copy_from_user(buf, (char __user *)uaddr + len, len), 0);
+	for (i = 0; i < len; i++)
+		if (buf[i] != (char)(i % 251))
+			break;
+	KUNIT_EXPECT_EQ(test, i, (int)len);
+
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->dev.stats.aio_completed), 2L);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->dev.stats.aio_inflight), 0L);
+}
+
+/*
+ * shmem backing : capacity past 4MB, served
+ * through the page cache slots.
+ */
+static void fourmb_test_shmem(struct kunit *test) {
+	const unsigned long cap = 16UL << 20;
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	unsigned long hits, misses;
+	struct folio *folio;
+	struct page *page;
+	void *data;
+	char out[4];
+
+	KUNIT_ASSERT_EQ(test, fourmb_shmem_setup(&ctx->dev, cap, 4), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.capacity, cap);
+
+	/* last set of the last page */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, cap - 4, 's', 8), 4);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, cap);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, cap, 's', 1), 0);
+	KUNIT_EXPECT_NULL(test, ctx->dev.buf_list);
+
+	/* past 4MB, and unwritten space reads as zeroes */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, DEV_SIZE + 1, 'm', 2), 2);
+	filp->f_pos = DEV_SIZE;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 4, &filp->f_pos), 4);
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ctx->ubuf, 4), 0);
+	KUNIT_EXPECT_MEMEQ(test, out, "\0mm\0", 4);
+
+	/* the second access to the same page hits */
+	KUNIT_EXPECT_GT(test, fourmb_stat_read(ctx->dev.stats.pcache_hits), 0UL);
+	KUNIT_EXPECT_GT(test, fourmb_stat_read(ctx->dev.stats.pcache_misses), 0UL);
+
+	/* clean truncates the backing */
+	fourmb_device_clean(&ctx->dev);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 0UL);
+	KUNIT_EXPECT_EQ(test, ctx->dev.capacity, cap);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, DEV_SIZE, 'n', 1), 1);
+	filp->f_pos = DEV_SIZE;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 4, &filp->f_pos), 1);
+	KUNIT_ASSERT_EQ(test, copy_from_user(out, ctx->ubuf, 1), 0);
+	KUNIT_EXPECT_EQ(test, out[0], 'n');
+
+	/* the scrubber checks resident pages only and leaves the slots be */
+	fourmb_device_clean(&ctx->dev);
+	KUNIT_ASSERT_EQ(test, fourmb_crc_setup(&ctx->dev), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, DEV_SIZE, 'o', 8), 8);
+	data = fourmb_set_get(&ctx->dev, DEV_SIZE / SET_SIZE, false, &page);
+	KUNIT_ASSERT_FALSE(test, IS_ERR_OR_NULL(data));
+	((u8 *)data)[3] ^= 0x10;
+	fourmb_set_put(data, page, true);
+	hits = fourmb_stat_read(ctx->dev.stats.pcache_hits);
+	misses = fourmb_stat_read(ctx->dev.stats.pcache_misses);
+	KUNIT_EXPECT_EQ(test, fourmb_scrub_pass(&ctx->dev, false), 1UL);
+	KUNIT_EXPECT_EQ(test, fourmb_stat_read(ctx->dev.stats.pcache_hits), hits);
+	KUNIT_EXPECT_EQ(test, fourmb_stat_read(ctx->dev.stats.pcache_misses), misses);
+	/* nor populated the untouched pages below it */
+	folio = filemap_get_folio(ctx->dev.shmem->f_mapping, 0);
+	KUNIT_EXPECT_TRUE(test, IS_ERR(folio));
+	if (!IS_ERR(folio))
+		folio_put(folio);
+}
+
+/*
+ * crc mode : incremental updates match a full
+ * recompute, corruption is caught by reads and
+ * the scrubber and survives later writes.
+ */
+static void fourmb_test_crc(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	struct fourmb_ll *ll;
+	struct iov_iter iter;
+	struct kiocb iocb;
+
+	KUNIT_ASSERT_EQ(test, fourmb_crc_setup(&ctx->dev), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.nr_sets, (unsigned long)NUM_SETS);
+
+	/* the shift table appends zeroes like hashing them does */
+	KUNIT_EXPECT_EQ(test, fourmb_crc_mult(fourmb_crc_shift[0], 0x1234u), 0x1234u);
+	KUNIT_EXPECT_EQ(test, fourmb_crc_mult(fourmb_crc_shift[7], 0x1234u),
+			crc32c(0x1234, page_address(ZERO_PAGE(0)), 7));
+	KUNIT_EXPECT_EQ(test, fourmb_crc_mult(fourmb_crc_shift[SET_SIZE], 0xdeadbeefu),
+			crc32c(0xdeadbeef, page_address(ZERO_PAGE(0)), SET_SIZE));
+
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 10, 'c', 100), 100);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, SET_SIZE - 1, 'd', 1), 1);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'e', SET_SIZE), SET_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 40, 'f', 3), 3);
+	ll = compute_dev_idx_ptr(&ctx->dev, 0);
+	KUNIT_ASSERT_NOT_NULL(test, ll);
+	KUNIT_EXPECT_EQ(test, ctx->dev.crc[0], crc32c(~0, ll->data, SET_SIZE));
+
+	/* the iov_iter path, across two sets */
+	init_sync_kiocb(&iocb, filp);
+	iocb.ki_pos = SET_SIZE - 8;
+	iov_iter_ubuf(&iter, ITER_SOURCE, ctx->ubuf, 16);
+	KUNIT_EXPECT_EQ(test, fourmb_write_iter(&iocb, &iter), 16);
+	KUNIT_EXPECT_EQ(test, ctx->dev.crc[0], crc32c(~0, ll->data, SET_SIZE));
+	KUNIT_EXPECT_EQ(test, ctx->dev.crc[1], crc32c(~0, ll->next->data, SET_SIZE));
+
+	filp->f_pos = 0;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 64, &filp->f_pos), 64);
+	KUNIT_EXPECT_EQ(test, fourmb_scrub_pass(&ctx->dev, false), 0UL);
+
+	/* flip a bit behind the driver's back */
+	((u8 *)ll->data)[300] ^= 0x10;
+	filp->f_pos = 0;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 64, &filp->f_pos), -EIO);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->dev.stats.crc_mismatch), 1L);
+	KUNIT_EXPECT_EQ(test, fourmb_scrub_pass(&ctx->dev, false), 1UL);
+
+	/* a write elsewhere in the set keeps the error visible */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'g', 8), 8);
+	iocb.ki_pos = 0;
+	iov_iter_ubuf(&iter, ITER_DEST, ctx->ubuf, 64);
+	KUNIT_EXPECT_EQ(test, fourmb_read_iter(&iocb, &iter), -EIO);
+
+	/* set 1 is still fine */
+	filp->f_pos = SET_SIZE;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 8, &filp->f_pos), 8);
+
+	/* a clean starts over */
+	fourmb_device_clean(&ctx->dev);
+	KUNIT_EXPECT_EQ(test, ctx->dev.crc[0], ctx->dev.crc_zero);
+}
+
+/*
+ * O_APPEND : whole records at the end,
+ * whatever f_pos says.
+ */
+static void fourmb_test_append(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	struct inode *inode;
+	char *buf;
+
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'a', 10), 10);
+
+	/* a write only appender does not truncate, and gets the sets preallocated */
+	inode = kunit_kzalloc(test, sizeof(*inode), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, inode);
+	inode->i_cdev = &ctx->dev.cdev;
+	filp->f_flags = O_WRONLY | O_APPEND;
+	KUNIT_EXPECT_EQ(test, fourmb_open(inode, filp), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 10UL);
+	KUNIT_EXPECT_NOT_NULL(test, ctx->dev.set_index);
+
+	/* a record crossing a set is not split */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'b', SET_SIZE + 100), SET_SIZE + 100);
+	KUNIT_EXPECT_EQ(test, filp->f_pos, (loff_t)(SET_SIZE + 110));
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 3, 'c', 5), 5);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, (unsigned long)SET_SIZE + 115);
+
+	buf = kunit_kmalloc(test, SET_SIZE + 115, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	filp->f_flags = O_RDWR;
+	filp->f_pos = 0;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, SET_SIZE, &filp->f_pos), SET_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf + SET_SIZE, 115, &filp->f_pos), 115);
+	KUNIT_ASSERT_EQ(test, copy_from_user(buf, ctx->ubuf, SET_SIZE + 115), 0);
+	KUNIT_EXPECT_EQ(test, buf[9], 'a');
+	KUNIT_EXPECT_EQ(test, buf[10], 'b');
+	KUNIT_EXPECT_EQ(test, buf[SET_SIZE + 109], 'b');
+	KUNIT_EXPECT_EQ(test, buf[SET_SIZE + 110], 'c');
+
+	/* a plain write past the tail moves it */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 4 * SET_SIZE, 'd', 1), 1);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->dev.append_tail), 4L * SET_SIZE + 1);
+
+	/* a faulting record is published as zeroes and fails */
+	filp->f_flags = O_WRONLY | O_APPEND;
+	filp->f_pos = 0;
+	KUNIT_EXPECT_EQ(test, fourmb_write(filp, NULL, 6, &filp->f_pos), -EFAULT);
+	KUNIT_EXPECT_EQ(test, filp->f_pos, 0LL);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 4UL * SET_SIZE + 7);
+	KUNIT_EXPECT_EQ(test, ((char *)compute_dev_idx_ptr(&ctx->dev, 4)->data)[1], 0);
+	KUNIT_EXPECT_EQ(test, ((char *)compute_dev_idx_ptr(&ctx->dev, 4)->data)[6], 0);
+
+	/* the end of the device, records fit whole or fail */
+	atomic_long_set(&ctx->dev.append_tail, DEV_SIZE - 10);
+	ctx->dev.size = DEV_SIZE - 10;
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'e', 8), 8);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'e', 8), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, (unsigned long)DEV_SIZE - 2);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'e', 1), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, (unsigned long)DEV_SIZE - 2);
+}
+
+/*
+ * Appenders on kthreads write records of
+ * { thread, seq, fill } through kvec iterators.
+ */
+struct fourmb_test_rec {
+	u32 thread;
+	u32 seq;
+	u8 fill[16];
+};
+
+struct fourmb_test_appender {
+	struct fourmb_dev *dev;
+	struct completion *start;
+	struct completion done;
+	u32 thread, nr;
+	u64 ns;
+};
+
+static int fourmb_test_appender_fn(void *arg) {
+	struct fourmb_test_appender *a = arg;
+	struct fourmb_test_rec rec;
+	struct iov_iter iter;
+	struct kvec kv;
+	loff_t pos;
+	u64 start;
+	u32 i;
+
+	wait_for_completion(a->start);
+	start = ktime_get_ns();
+	for (i = 0; i < a->nr; i++) {
+		rec.thread = a->thread;
+		rec.seq = i;
+		memset(rec.fill, a->thread, sizeof(rec.fill));
+		kv.iov_base = &rec;
+		kv.iov_len = sizeof(rec);
+		iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, sizeof(rec));
+		if (fourmb_append(a->dev, &iter, &pos) != sizeof(rec))
+			break;
+	}
+	a->ns = ktime_get_ns() - start;
+	complete(&a->done);
+	return 0;
+}
+
+/* runs nr_threads appenders of nr records each, returns the slowest one's ns */
+static u64 fourmb_test_run_appenders(struct kunit *test, int nr_threads, u32 nr) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct fourmb_test_appender *a;
+	struct task_struct *t;
+	struct completion start;
+	u64 ns = 0;
+	int i, started;
+
+	a = kunit_kcalloc(test, nr_threads, sizeof(*a), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, a);
+	init_completion(&start);
+	for (i = 0; i < nr_threads; i++) {
+		a[i].dev = &ctx->dev;
+		a[i].start = &start;
+		a[i].thread = i;
+		a[i].nr = nr;
+		init_completion(&a[i].done);
+		t = kthread_run(fourmb_test_appender_fn, &a[i], "fourmb_app%d", i);
+		if (IS_ERR(t))
+			break;
+	}
+	started = i;
+
+	/* the started ones wait on start, which lives on this stack */
+	complete_all(&start);
+	for (i = 0; i < started; i++) {
+		wait_for_completion(&a[i].done);
+		ns = max(ns, a[i].ns);
+	}
+	KUNIT_ASSERT_EQ(test, started, nr_threads);
+	return ns;
+}
+
+static void fourmb_test_append_concurrent(struct kunit *test) {
+	const int nr_threads = 4;
+	const u32 nr = 2000;
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct fourmb_test_rec rec;
+	u32 next[4] = { 0 };
+	struct page *page;
+	unsigned long off;
+	void *data;
+	int i;
+
+	KUNIT_ASSERT_EQ(test, fourmb_prealloc(&ctx->dev), 0);
+	fourmb_test_run_appenders(test, nr_threads, nr);
+	KUNIT_ASSERT_EQ(test, ctx->dev.size, (unsigned long)nr_threads * nr * sizeof(rec));
+
+	/* every record whole, each thread's in order */
+	for (off = 0; off < ctx->dev.size; off += sizeof(rec)) {
+		/* records are 24 bytes so they may straddle sets */
+		for (i = 0; i < sizeof(rec); i++) {
+			data = fourmb_set_get(&ctx->dev, (off + i) / SET_SIZE, false, &page);
+			((u8 *)&rec)[i] = ((u8 *)data)[(off + i) % SET_SIZE];
+			fourmb_set_put(data, page, false);
+		}
+		KUNIT_ASSERT_LT(test, rec.thread, (u32)nr_threads);
+		KUNIT_EXPECT_EQ(test, rec.seq, next[rec.thread]);
+		KUNIT_EXPECT_EQ(test, rec.fill[15], (u8)rec.thread);
+		next[rec.thread] = rec.seq + 1;
+	}
+	for (i = 0; i < nr_threads; i++)
+		KUNIT_EXPECT_EQ(test, next[i], nr);
+}
+
+/* starts one appender of one record behind a reserved, unpublished [size, size + 64) */
+static void fourmb_test_start_stalled(struct kunit *test, struct fourmb_test_appender *a,
+		struct completion *start) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	unsigned long tail = ctx->dev.size + 64;
+	struct task_struct *t;
+	int i;
+
+	atomic_long_set(&ctx->dev.append_tail, tail);
+	a->dev = &ctx->dev;
+	a->start = start;
+	a->nr = 1;
+	init_completion(&a->done);
+	init_completion(start);
+	t = kthread_run(fourmb_test_appender_fn, a, "fourmb_stall");
+	KUNIT_ASSERT_FALSE(test, IS_ERR(t));
+	complete_all(start);
+
+	/* it reserves, copies, then waits without the sem */
+	for (i = 0; i < 100 && atomic_long_read(&ctx->dev.append_tail) == tail; i++)
+		msleep(10);
+	KUNIT_ASSERT_EQ(test, atomic_long_read(&ctx->dev.append_tail),
+			(long)(tail + sizeof(struct fourmb_test_rec)));
+	for (i = 0; i < 100 && !down_write_trylock(&ctx->dev.sem); i++)
+		msleep(10);
+	KUNIT_ASSERT_LT(test, i, 100);
+}
+
+/*
+ * An appender waiting on an earlier record
+ * that is slow to publish holds no lock, wakes
+ * when that record is published, and drops its
+ * own record when a truncating open cleans
+ * the device meanwhile.
+ */
+static void fourmb_test_append_stall(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct fourmb_test_appender a = { 0 };
+	struct completion start;
+
+	KUNIT_ASSERT_EQ(test, fourmb_prealloc(&ctx->dev), 0);
+	fourmb_test_start_stalled(test, &a, &start);
+	up_write(&ctx->dev.sem);
+	KUNIT_EXPECT_EQ(test, wait_for_completion_timeout(&a.done, HZ / 10), 0UL);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 0UL);
+
+	/* publish the record ahead of it */
+	down_read(&ctx->dev.sem);
+	fourmb_size_extend(&ctx->dev, 64);
+	smp_mb();
+	wake_up_var(fourmb_append_var(&ctx->dev, 64));
+	up_read(&ctx->dev.sem);
+	KUNIT_ASSERT_NE(test, wait_for_completion_timeout(&a.done, 10 * HZ), 0UL);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 64UL + sizeof(struct fourmb_test_rec));
+
+	/* a clean while it waits */
+	fourmb_test_start_stalled(test, &a, &start);
+	fourmb_device_clean(&ctx->dev);
+	up_write(&ctx->dev.sem);
+	KUNIT_ASSERT_NE(test, wait_for_completion_timeout(&a.done, 10 * HZ), 0UL);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 0UL);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->dev.append_tail), 0L);
+}
+
+/*
+ * FOURMB_IOC_WCOMBINE : small writes wait in
+ * the open's buffer, this open still reads
+ * them back.
+ */
+static void fourmb_test_wcombine(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	struct iov_iter iter;
+	struct kiocb iocb;
+	char buf[13];
+
+	KUNIT_ASSERT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_WCOMBINE, 1), 0);
+
+	/* adjacent writes coalesce and stay off the sets */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'a', 3), 3);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 3, 'b', 10), 10);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 1, 'c', 1), 1);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 0UL);
+	KUNIT_EXPECT_NULL(test, ctx->dev.buf_list);
+	KUNIT_EXPECT_EQ(test, ctx->file.wc_len, 13U);
+
+	/* an overlapping read writes them back first */
+	filp->f_pos = 0;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 13, &filp->f_pos), 13);
+	KUNIT_ASSERT_EQ(test, copy_from_user(buf, ctx->ubuf, 13), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(buf, "acabbbbbbbbbb", 13), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 13UL);
+	KUNIT_EXPECT_EQ(test, ctx->file.wc_len, 0U);
+
+	/* a gap starts a new range, fsync and lseek(SEEK_END) write back */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 20, 'd', 2), 2);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 30, 'e', 2), 2);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 22UL);
+	KUNIT_EXPECT_EQ(test, fourmb_fsync(filp, 0, LLONG_MAX, 0), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 32UL);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 32, 'f', 8), 8);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, 0, SEEK_END), 40);
+
+	/* a read past the size sees what staging past it would add */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 50, 'x', 2), 2);
+	filp->f_pos = 40;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 5, &filp->f_pos), 5);
+	KUNIT_ASSERT_EQ(test, copy_from_user(buf, ctx->ubuf, 5), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(buf, "\0\0\0\0\0", 5), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 52UL);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 60, 'y', 2), 2);
+	init_sync_kiocb(&iocb, filp);
+	iocb.ki_pos = 55;
+	iov_iter_ubuf(&iter, ITER_DEST, ctx->ubuf, 3);
+	KUNIT_EXPECT_EQ(test, fourmb_read_iter(&iocb, &iter), 3);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 62UL);
+
+	/* filling the set writes it back */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, SET_SIZE - 4, 'g', 4), 4);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, (unsigned long)SET_SIZE);
+
+	/* set crossing and big writes go straight through, short as before */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, SET_SIZE, 'h', 2), 2);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, (unsigned long)SET_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 2 * SET_SIZE - 2, 'i', 4), 2);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 2UL * SET_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'j', FOURMB_WC_MAX), FOURMB_WC_MAX);
+	KUNIT_EXPECT_EQ(test, ctx->file.wc_len, 0U);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, DEV_SIZE, 'k', 1), 0);
+
+	/* turning it off writes back too */
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 2 * SET_SIZE, 'l', 1), 1);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 2UL * SET_SIZE);
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_WCOMBINE, 0), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.size, 2UL * SET_SIZE + 1);
+	KUNIT_EXPECT_NULL(test, ctx->file.wc_buf);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->dev.stats.wc_staged), 11L);
+}
+
+/*
+ * Capture : records come out whole, in call
+ * order, and a full ring drops new ones.
+ */
+static void fourmb_test_trace(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	struct fourmb_trace_rec rec[4];
+	u64 start = ktime_get_ns();
+
+	KUNIT_ASSERT_EQ(test, fourmb_trace_setup(&ctx->dev, 3), 0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.trace.mask, 3UL);
+
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 5, 'a', 3), 3);
+	filp->f_pos = 5;
+	KUNIT_EXPECT_EQ(test, fourmb_read(filp, ctx->ubuf, 100, &filp->f_pos), 3);
+	KUNIT_EXPECT_EQ(test, fourmb_lseek(filp, -2, SEEK_END), 6);
+	KUNIT_EXPECT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_HELLO, 0), 0);
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 8, 'b', 1), 1);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->dev.trace.lost), 1L);
+
+	/* only whole records */
+	KUNIT_EXPECT_EQ(test, fourmb_trace_drain(&ctx->dev.trace, ctx->ubuf, sizeof(rec[0]) - 1), -EINVAL);
+	KUNIT_EXPECT_EQ(test, fourmb_trace_drain(&ctx->dev.trace, ctx->ubuf, 2 * sizeof(rec[0]) + 5),
+			2 * sizeof(rec[0]));
+	KUNIT_EXPECT_EQ(test, fourmb_trace_drain(&ctx->dev.trace, ctx->ubuf + 2 * sizeof(rec[0]), PAGE_SIZE),
+			2 * sizeof(rec[0]));
+	KUNIT_EXPECT_EQ(test, fourmb_trace_drain(&ctx->dev.trace, ctx->ubuf, PAGE_SIZE), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(rec, ctx->ubuf, sizeof(rec)), 0);
+
+	KUNIT_EXPECT_EQ(test, rec[0].op, FOURMB_TRACE_WRITE);
+	KUNIT_EXPECT_EQ(test, rec[0].off, 5ULL);
+	KUNIT_EXPECT_EQ(test, rec[0].len, 3U);
+	KUNIT_EXPECT_EQ(test, rec[0].pid, (u32)task_pid_nr(current));
+	KUNIT_EXPECT_GE(test, rec[0].ts_ns, start);
+	KUNIT_EXPECT_EQ(test, rec[1].op, FOURMB_TRACE_READ);
+	KUNIT_EXPECT_EQ(test, rec[1].len, 100U);
+	KUNIT_EXPECT_GE(test, rec[1].ts_ns, rec[0].ts_ns);
+	KUNIT_EXPECT_EQ(test, rec[2].op, FOURMB_TRACE_LSEEK);
+	KUNIT_EXPECT_EQ(test, rec[2].off, (u64)-2);
+	KUNIT_EXPECT_EQ(test, rec[2].len, (u32)SEEK_END);
+	KUNIT_EXPECT_EQ(test, rec[3].op, FOURMB_TRACE_IOCTL);
+	KUNIT_EXPECT_EQ(test, rec[3].len, (u32)FOURMB_IOC_HELLO);
+
+	/* drained slots are reused, appends are flagged */
+	filp->f_flags = O_RDWR | O_APPEND;
+	KUNIT_EXPECT_EQ(test, fourmb_test_write(test, 0, 'c', 2), 2);
+	KUNIT_EXPECT_EQ(test, fourmb_trace_drain(&ctx->dev.trace, ctx->ubuf, PAGE_SIZE), sizeof(rec[0]));
+	KUNIT_ASSERT_EQ(test, copy_from_user(rec, ctx->ubuf, sizeof(rec[0])), 0);
+	KUNIT_EXPECT_EQ(test, rec[0].op, FOURMB_TRACE_WRITE);
+	KUNIT_EXPECT_EQ(test, rec[0].flags, FOURMB_TRACE_F_APPEND);
+}
+
+/*
+ * Microbenchmarks
+ * ---------------
+ *
+ * Not pass/fail, they log ns/op so that runs
+ * before and after a change can be compared.
+ */
+static const int fourmb_bench_sets[] = { 0, 1, 64, 1024, NUM_SETS - 1 };
+
+static void fourmb_bench_lookup(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	u64 start, ns;
+	int i, j;
+
+	/* populate the whole list once so that only the walk is timed */
+	KUNIT_ASSERT_NOT_NULL(test, compute_dev_idx_ptr(&ctx->dev, NUM_SETS - 1));
+
+	for (i = 0; i < ARRAY_SIZE(fourmb_bench_sets); i++) {
+		start = ktime_get_ns();
+		for (j = 0; j < FOURMB_BENCH_ITERS; j++)
+			compute_dev_idx_ptr(&ctx->dev, fourmb_bench_sets[i]);
+		ns = ktime_get_ns() - start;
+		kunit_info(test, "lookup set %5d: %llu ns/op\n",
+				fourmb_bench_sets[i], div_u64(ns, FOURMB_BENCH_ITERS));
+		cond_resched();
+	}
+}
+
+/* ns/op of len byte writes then reads at pos, FOURMB_BENCH_ITERS of each */
+static void fourmb_bench_rw(struct kunit *test, loff_t pos, size_t len, u64 *wns, u64 *rns) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	u64 start;
+	int j;
+
+	start = ktime_get_ns();
+	for (j = 0; j < FOURMB_BENCH_ITERS; j++) {
+		filp->f_pos = pos;
+		fourmb_write(filp, ctx->ubuf, len, &filp->f_pos);
+	}
+	*wns = div_u64(ktime_get_ns() - start, FOURMB_BENCH_ITERS);
+
+	start = ktime_get_ns();
+	for (j = 0; j < FOURMB_BENCH_ITERS; j++) {
+		filp->f_pos = pos;
+		fourmb_read(filp, ctx->ubuf, len, &filp->f_pos);
+	}
+	*rns = div_u64(ktime_get_ns() - start, FOURMB_BENCH_ITERS);
+	cond_resched();
+}
+
+static void fourmb_bench_copy(struct kunit *test) {
+	static const size_t lens[] = { 1, 16, SET_SIZE };
+	u64 wns, rns;
+	loff_t pos;
+	int i, l;
+
+	for (i = 0; i < ARRAY_SIZE(fourmb_bench_sets); i++) {
+		pos = (loff_t)fourmb_bench_sets[i] * SET_SIZE;
+		/* fill up to the end of the set so reads are not trimmed */
+		KUNIT_ASSERT_EQ(test, fourmb_test_write(test, pos, 'b', SET_SIZE), SET_SIZE);
+
+		for (l = 0; l < ARRAY_SIZE(lens); l++) {
+			fourmb_bench_rw(test, pos, lens[l], &wns, &rns);
+			kunit_info(test, "set %5d len %3zu: write %llu ns/op, read %llu ns/op\n",
+					fourmb_bench_sets[i], lens[l], wns, rns);
+		}
+	}
+}
+
+static void fourmb_bench_meta(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	char key[FOURMB_META_KEYLEN], val[FOURMB_META_VALLEN];
+	u64 start, ns;
+	int i, j;
+
+	for (i = 0; i < 1024; i++) {
+		snprintf(key, sizeof(key), "region%d", i);
+		KUNIT_ASSERT_EQ(test, fourmb_meta_put(&ctx->dev, key, "tag"), 0);
+	}
+
+	start = ktime_get_ns();
+	for (j = 0; j < FOURMB_BENCH_ITERS; j++)
+		fourmb_meta_get(&ctx->dev, "region512", val);
+	ns = ktime_get_ns() - start;
+	kunit_info(test, "meta get, 1024 entries: %llu ns/op\n", div_u64(ns, FOURMB_BENCH_ITERS));
+
+	start = ktime_get_ns();
+	for (j = 0; j < FOURMB_BENCH_ITERS; j++)
+		fourmb_meta_put(&ctx->dev, "region512", (j & 1) ? "odd" : "even");
+	ns = ktime_get_ns() - start;
+	kunit_info(test, "meta put, 1024 entries: %llu ns/op\n", div_u64(ns, FOURMB_BENCH_ITERS));
+}
+
+/* set copies over shmem, with and without page cache slots */
+static void fourmb_bench_shmem(struct kunit *test) {
+	static const unsigned int caches[] = { 0, 256 };
+	struct fourmb_test_ctx *ctx = test->priv;
+	u64 wns, rns;
+	loff_t pos;
+	int c, i;
+
+	for (c = 0; c < ARRAY_SIZE(caches); c++) {
+		KUNIT_ASSERT_EQ(test, fourmb_shmem_setup(&ctx->dev, 64UL << 20, caches[c]), 0);
+
+		for (i = 0; i < ARRAY_SIZE(fourmb_bench_sets); i++) {
+			pos = (loff_t)fourmb_bench_sets[i] * SET_SIZE * 16;
+			KUNIT_ASSERT_EQ(test, fourmb_test_write(test, pos, 'b', SET_SIZE), SET_SIZE);
+			fourmb_bench_rw(test, pos, SET_SIZE, &wns, &rns);
+			kunit_info(test, "shmem cache %3u offset %9lld: write %llu ns/op, read %llu ns/op\n",
+					caches[c], pos, wns, rns);
+		}
+
+		fourmb_device_clean(&ctx->dev);
+		fourmb_shmem_release(&ctx->dev);
+	}
+}
+
+/* set copies with and without crc mode, the difference is its cost */
+static void fourmb_bench_crc(struct kunit *test) {
+	static const size_t lens[] = { 1, 16, SET_SIZE };
+	struct fourmb_test_ctx *ctx = test->priv;
+	u64 start, wns, rns;
+	int mode, l, j;
+
+	for (mode = 0; mode < 2; mode++) {
+		if (mode) {
+			fourmb_device_clean(&ctx->dev);
+			KUNIT_ASSERT_EQ(test, fourmb_crc_setup(&ctx->dev), 0);
+		}
+		KUNIT_ASSERT_EQ(test, fourmb_test_write(test, 0, 'b', SET_SIZE), SET_SIZE);
+
+		for (l = 0; l < ARRAY_SIZE(lens); l++) {
+			fourmb_bench_rw(test, 0, lens[l], &wns, &rns);
+			kunit_info(test, "crc %s len %3zu: write %llu ns/op, read %llu ns/op\n",
+					mode ? "on " : "off", lens[l], wns, rns);
+		}
+	}
+
+	start = ktime_get_ns();
+	for (j = 0; j < 100; j++)
+		fourmb_scrub_pass(&ctx->dev, false);
+	kunit_info(test, "scrub of 1 set: %llu ns/pass\n", div_u64(ktime_get_ns() - start, 100));
+}
+
+/* append throughput against the number of writer threads */
+static void fourmb_bench_append(struct kunit *test) {
+	static const int threads[] = { 1, 2, 4, 8 };
+	struct fourmb_test_ctx *ctx = test->priv;
+	const u32 total = 64 * 1024;
+	u64 ns;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(threads); i++) {
+		fourmb_device_clean(&ctx->dev);
+		KUNIT_ASSERT_EQ(test, fourmb_prealloc(&ctx->dev), 0);
+		ns = fourmb_test_run_appenders(test, threads[i], total / threads[i]);
+		kunit_info(test, "append %d thread(s): %llu ns/record, %llu records/s\n",
+				threads[i], div_u64(ns, total),
+				ns ? div64_u64((u64)total * NSEC_PER_SEC, ns) : 0);
+		cond_resched();
+	}
+}
+
+/* sequential 3 and 10 byte writes, like lseek_test.c and ioctl_test.c */
+static void fourmb_bench_wcombine(struct kunit *test) {
+	static const size_t lens[] = { 3, 10 };
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	u64 start, ns[2];
+	int l, on, j;
+
+	for (l = 0; l < ARRAY_SIZE(lens); l++) {
+		for (on = 0; on < 2; on++) {
+			KUNIT_ASSERT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_WCOMBINE, on), 0);
+			filp->f_pos = 0;
+			start = ktime_get_ns();
+			for (j = 0; j < FOURMB_BENCH_ITERS; j++)
+				fourmb_write(filp, ctx->ubuf, lens[l], &filp->f_pos);
+			KUNIT_EXPECT_EQ(test, fourmb_fsync(filp, 0, LLONG_MAX, 0), 0);
+			ns[on] = ktime_get_ns() - start;
+		}
+		KUNIT_ASSERT_EQ(test, fourmb_ioctl(filp, FOURMB_IOC_WCOMBINE, 0), 0);
+		kunit_info(test, "len %2zu: direct %llu ns/write, combined %llu ns/write\n",
+				lens[l], div_u64(ns[0], FOURMB_BENCH_ITERS),
+				div_u64(ns[1], FOURMB_BENCH_ITERS));
+		cond_resched();
+	}
+}
+
+/* what capture adds to a 1 byte write */
+static void fourmb_bench_trace(struct kunit *test) {
+	struct fourmb_test_ctx *ctx = test->priv;
+	struct file *filp = &ctx->filp;
+	u64 start, ns[2];
+	int on, j;
+
+	for (on = 0; on < 2; on++) {
+		if (on)
+			KUNIT_ASSERT_EQ(test, fourmb_trace_setup(&ctx->dev, FOURMB_BENCH_ITERS), 0);
+		start = ktime_get_ns();
+		for (j = 0; j < FOURMB_BENCH_ITERS; j++) {
+			filp->f_pos = j;
+			fourmb_write(filp, ctx->ubuf, 1, &filp->f_pos);
+		}
+		ns[on] = ktime_get_ns() - start;
+	}
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->dev.trace.lost), 0L);
+	kunit_info(test, "write: %llu ns/op, traced %llu ns/op\n",
+			div_u64(ns[0], FOURMB_BENCH_ITERS), div_u64(ns[1], FOURMB_BENCH_ITERS));
+}
+
+static struct kunit_case fourmb_test_cases[] = {
+	KUNIT_CASE(fourmb_test_set_alloc),
+	KUNIT_CASE(fourmb_test_set_boundary),
+	KUNIT_CASE(fourmb_test_lseek),
+	KUNIT_CASE(fourmb_test_size),
+	KUNIT_CASE(fourmb_test_ioctl),
+	KUNIT_CASE(fourmb_test_meta),
+	KUNIT_CASE(fourmb_test_iter_sync),
+	KUNIT_CASE(fourmb_test_iter_async),
+	KUNIT_CASE(fourmb_test_shmem),
+	KUNIT_CASE(fourmb_test_crc),
+	KUNIT_CASE(fourmb_test_append),
+	KUNIT_CASE(fourmb_test_append_concurrent),
+	KUNIT_CASE(fourmb_test_append_stall),
+	KUNIT_CASE(fourmb_test_wcombine),
+	KUNIT_CASE(fourmb_test_trace),
+	KUNIT_CASE_SLOW(fourmb_bench_lookup),
+	KUNIT_CASE_SLOW(fourmb_bench_copy),
+	KUNIT_CASE_SLOW(fourmb_bench_meta),
+	KUNIT_CASE_SLOW(fourmb_bench_shmem),
+	KUNIT_CASE_SLOW(fourmb_bench_crc),
+	KUNIT_CASE_SLOW(fourmb_bench_append),
+	KUNIT_CASE_SLOW(fourmb_bench_wcombine),
+	KUNIT_CASE_SLOW(fourmb_bench_trace),
+	{}
+};
+
+static struct kunit_suite fourmb_test_suite = {
+	.name		= "fourmb_device",
+	.init		= fourmb_test_init,
+	.exit		= fourmb_test_exit,
+	.test_cases	= fourmb_test_cases,
+};
+kunit_test_suite(fourmb_test_suite);
@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+/*
+ * Captures and replays traffic of the 4MB device.
+ *
+ *	fourmb_replay -c trace.bin
+ *		drains /proc/fourmb_trace (module loaded with
+ *		trace_records=N) into trace.bin until ^C
+ *
+ *	fourmb_replay [-f] [-d device] trace.bin
+ *		plays trace.bin back, one thread per traced pid,
+ *		at the original timing or flat out (-f), and
+ *		reports throughput and latency per call type
+ *
+ * gcc -O2 -o fourmb_replay fourmb_replay.c -lpthread
+ */
+
+/* must match struct fourmb_trace_rec in fourmb_device_driver.c */
+struct fourmb_trace_rec {
+	uint64_t ts_ns;
+	uint64_t off;
+	uint32_t len;
+	uint32_t pid;
+	uint16_t op;
+	uint16_t flags;
+	uint32_t cpu;
+};
+
+#define FOURMB_TRACE_READ		1
+#define FOURMB_TRACE_WRITE		2
+#define FOURMB_TRACE_LSEEK		3
+#define FOURMB_TRACE_IOCTL		4
+#define FOURMB_TRACE_NR_OPS		5
+
+#define FOURMB_TRACE_F_APPEND	0x1
+
+#define MAX_THREADS	256
+#define MAX_LEN		(4 << 20)
+
+static const char *op_names[FOURMB_TRACE_NR_OPS] = { "?", "read", "write", "lseek", "ioctl" };
+
+static const char *dev_path = "/dev/fourmb_device_driver";
+static int flat_out;
+static struct fourmb_trace_rec *recs;
+static size_t nr_recs;
+static uint64_t ts0;
+static struct timespec start;
+static pthread_barrier_t barrier;
+static volatile sig_atomic_t stop;
+
+struct replayer {
+	pthread_t thread;
+	uint32_t pid;
+	size_t *idx;		/* its records, in trace order */
+	size_t nr;
+	uint64_t *lat_ns;	/* per record */
+	uint64_t bytes;
+	uint64_t late_ns;	/* worst lag behind the trace */
+	size_t errors, skipped;
+};
+
+static struct replayer threads[MAX_THREADS];
+static int nr_threads;
+
+static uint64_t ts_ns(const struct timespec *ts) {
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_ns(&ts);
+}
+
+static void on_sigint(int sig) {
+	stop = 1;
+}
+
+int capture(const char *out) {
+	static struct fourmb_trace_rec buf[4096];
+	size_t total = 0;
+	ssize_t k;
+	FILE *f;
+	int fd;
+
+	fd = open("/proc/fourmb_trace", O_RDONLY);
+	if (fd == -1) {
+		perror("unable to open /proc/fourmb_trace, load with trace_records=N");
+		return EXIT_FAILURE;
+	}
+	f = fopen(out, "w");
+	if (!f) {
+		perror(out);
+		return EXIT_FAILURE;
+	}
+	signal(SIGINT, on_sigint);
+	while (!stop) {
+		k = read(fd, buf, sizeof(buf));
+		if (k < 0 && errno != EINTR) {
+			perror("read");
+			break;
+		}
+		if (k > 0) {
+			fwrite(buf, 1, k, f);
+			total += k / sizeof(buf[0]);
+		} else {
+			usleep(100000);
+		}
+	}
+	fclose(f);
+	close(fd);
+	printf("fourmb_replay: captured %zu records\n", total);
+	return 0;
+}
+
+static int load(const char *path) {
+	FILE *f = fopen(path, "r");
+	long size;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	nr_recs = size / sizeof(*recs);
+	recs = malloc(nr_recs * sizeof(*recs) + 1);
+	if (!recs || fread(recs, sizeof(*recs), nr_recs, f) != nr_recs) {
+		fprintf(stderr, "fourmb_replay: unable to read %s\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int find_thread(uint32_t pid) {
+	int t;
+
+	for (t = 0; t < nr_threads && threads[t].pid != pid; t++)
+		;
+	return t;
+}
+
+/* one replayer per traced pid, sized by a first counting pass */
+static int split(void) {
+	size_t i;
+	int t;
+
+	for (i = 0; i < nr_recs; i++) {
+		t = find_thread(recs[i].pid);
+		if (t == nr_threads) {
+			if (nr_threads == MAX_THREADS) {
+				fprintf(stderr, "fourmb_replay: more than %d pids\n", MAX_THREADS);
+				return -1;
+			}
+			threads[t].pid = recs[i].pid;
+			nr_threads++;
+		}
+		threads[t].nr++;
+		if (i == 0 || recs[i].ts_ns < ts0)
+			ts0 = recs[i].ts_ns;
+	}
+	for (t = 0; t < nr_threads; t++) {
+		threads[t].idx = malloc(threads[t].nr * sizeof(size_t));
+		threads[t].lat_ns = malloc(threads[t].nr * sizeof(uint64_t));
+		if (!threads[t].idx || !threads[t].lat_ns) {
+			fprintf(stderr, "fourmb_replay: out of memory\n");
+			return -1;
+		}
+		threads[t].nr = 0;
+	}
+	for (i = 0; i < nr_recs; i++) {
+		t = find_thread(recs[i].pid);
+		threads[t].idx[threads[t].nr++] = i;
+	}
+	return 0;
+}
+
+static void *replay(void *arg) {
+	struct replayer *r = arg;
+	static char scratch[4096];
+	const struct fourmb_trace_rec *rec;
+	struct timespec due;
+	uint64_t t, due_ns = 0;
+	int fd, afd = -1;
+	ssize_t k;
+	size_t i;
+	char *buf;
+
+	buf = calloc(1, MAX_LEN);
+	fd = open(dev_path, O_RDWR);
+	if (!buf || fd == -1) {
+		perror("unable to open the device");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < r->nr; i++) {
+		rec = &recs[r->idx[i]];
+		if (!flat_out) {
+			due_ns = ts_ns(&start) + (rec->ts_ns - ts0);
+			due.tv_sec = due_ns / 1000000000ULL;
+			due.tv_nsec = due_ns % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+		}
+
+		t = now_ns();
+		if (!flat_out && t - due_ns > r->late_ns)
+			r->late_ns = t - due_ns;
+		k = 0;
+		switch (rec->op) {
+		case FOURMB_TRACE_READ:
+			k = pread(fd, buf, rec->len < MAX_LEN ? rec->len : MAX_LEN, rec->off);
+			break;
+		case FOURMB_TRACE_WRITE:
+			if (rec->flags & FOURMB_TRACE_F_APPEND) {
+				/* opening O_APPEND does not truncate */
+				if (afd == -1)
+					afd = open(dev_path, O_RDWR | O_APPEND);
+				k = write(afd, buf, rec->len < MAX_LEN ? rec->len : MAX_LEN);
+			} else {
+				k = pwrite(fd, buf, rec->len < MAX_LEN ? rec->len : MAX_LEN, rec->off);
+			}
+			break;
+		case FOURMB_TRACE_LSEEK:
+			k = lseek(fd, (off_t)rec->off, rec->len) < 0 ? -1 : 0;
+			break;
+		case FOURMB_TRACE_IOCTL:
+			/* the payloads of writing ioctls are not in the trace */
+			if (_IOC_DIR(rec->len) == _IOC_NONE)
+				k = ioctl(fd, rec->len, (unsigned long)rec->off);
+			else if (_IOC_DIR(rec->len) == _IOC_READ && _IOC_SIZE(rec->len) <= sizeof(scratch))
+				k = ioctl(fd, rec->len, scratch);
+			else
+				r->skipped++;
+			break;
+		default:
+			r->skipped++;
+		}
+		r->lat_ns[i] = now_ns() - t;
+		if (k < 0)
+			r->errors++;
+		else if (rec->op == FOURMB_TRACE_READ || rec->op == FOURMB_TRACE_WRITE)
+			r->bytes += k;
+	}
+
+	if (afd != -1)
+		close(afd);
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(uint64_t wall_ns) {
+	uint64_t *lat, bytes = 0, late = 0;
+	size_t n, i, errors = 0, skipped = 0;
+	int op, t;
+
+	lat = malloc(nr_recs * sizeof(*lat) + 1);
+	for (t = 0; t < nr_threads; t++) {
+		bytes += threads[t].bytes;
+		errors += threads[t].errors;
+		skipped += threads[t].skipped;
+		if (threads[t].late_ns > late)
+			late = threads[t].late_ns;
+	}
+	printf("fourmb_replay: %zu calls from %d pid(s) in %.3f s, %s\n",
+			nr_recs, nr_threads, wall_ns / 1e9, flat_out ? "flat out" : "original timing");
+	printf("fourmb_replay: %.0f calls/s, %.2f MB/s, %zu errors, %zu skipped\n",
+			nr_recs / (wall_ns / 1e9), bytes / (wall_ns / 1e9) / (1 << 20), errors, skipped);
+	if (!flat_out)
+		printf("fourmb_replay: worst lag behind the trace %.1f us\n", late / 1e3);
+
+	printf("%-6s %10s %10s %10s %10s %10s\n", "op", "calls", "avg_ns", "p50_ns", "p99_ns", "max_ns");
+	for (op = 1; op < FOURMB_TRACE_NR_OPS; op++) {
+		uint64_t sum = 0;
+
+		n = 0;
+		for (t = 0; t < nr_threads; t++)
+			for (i = 0; i < threads[t].nr; i++)
+				if (recs[threads[t].idx[i]].op == op)
+					lat[n++] = threads[t].lat_ns[i];
+		if (!n)
+			continue;
+		qsort(lat, n, sizeof(*lat), cmp_u64);
+		for (i = 0; i < n; i++)
+			sum += lat[i];
+		printf("%-6s %10zu %10llu %10llu %10llu %10llu\n", op_names[op], n,
+				(unsigned long long)(sum / n), (unsigned long long)lat[n / 2],
+				(unsigned long long)lat[n * 99 / 100], (unsigned long long)lat[n - 1]);
+	}
+	free(lat);
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: fourmb_replay -c trace.bin\n"
+			"       fourmb_replay [-f] [-d device] trace.bin\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	uint64_t wall;
+	int opt, t;
+
+	while ((opt = getopt(argc, argv, "c:d:f")) != -1) {
+		switch (opt) {
+		case 'c':
+			return capture(optarg);
+		case 'd':
+			dev_path = optarg;
+			break;
+		case 'f':
+			flat_out = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	if (load(argv[optind]) || split())
+		exit(EXIT_FAILURE);
+	if (!nr_recs) {
+		printf("fourmb_replay: empty trace\n");
+		return 0;
+	}
+
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+	for (t = 0; t < nr_threads; t++) {
+		/* the barrier waits for all of them, do not go on short */
+		if ((errno = pthread_create(&threads[t].thread, NULL, replay, &threads[t]))) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* a little slack so that the first calls are not all late */
+	if (!flat_out)
+		start.tv_nsec += 1000000;
+	if (start.tv_nsec >= 1000000000) {
+		start.tv_sec++;
+		start.tv_nsec -= 1000000000;
+	}
+	pthread_barrier_wait(&barrier);
+	for (t = 0; t < nr_threads; t++)
+		pthread_join(threads[t].thread, NULL);
+	wall = now_ns() - ts_ns(&start);
+
+	report(wall);
+	return 0;
+}
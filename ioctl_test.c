@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 
 int lcd;
@@ -13,6 +16,16 @@ int lcd;
 #define FOURMB_IOC_LDSTM	_IOWR(FOURMB_IOC_MAGIC,4,unsigned long) /* Do both */
 #define FOURMB_IOC_MAXNR	4
 
+/* must match the driver */
+struct fourmb_meta_kv {
+	char key[32];
+	char val[64];
+	char old[64];
+};
+#define FOURMB_IOC_MGET		_IOWR(FOURMB_IOC_MAGIC,5,struct fourmb_meta_kv)
+#define FOURMB_IOC_MPUT		_IOW(FOURMB_IOC_MAGIC,6,struct fourmb_meta_kv)
+#define FOURMB_IOC_MCAS		_IOWR(FOURMB_IOC_MAGIC,7,struct fourmb_meta_kv)
+
 void test() {
 	int k, i, sum;
 	char s[3], user_msg[30] = "jkfvfvb", tmp[30];
@@ -37,6 +50,28 @@ void test() {
 	printf("ioctl_test: after swap user_msg %s\n",user_msg);
 }
 
+void test_meta() {
+	struct fourmb_meta_kv kv;
+	int k;
+
+	memset(&kv,0,sizeof(kv));
+	strcpy(kv.key,"region0");
+	strcpy(kv.val,"hot");
+	k = ioctl(lcd,FOURMB_IOC_MPUT,&kv);
+	printf("ioctl_test: put region0 = %d\n",k);
+
+	memset(kv.val,0,sizeof(kv.val));
+	k = ioctl(lcd,FOURMB_IOC_MGET,&kv);
+	printf("ioctl_test: get region0 = %d, %s\n",k,kv.val);
+
+	strcpy(kv.val,"cold");
+	strcpy(kv.old,"warm");
+	k = ioctl(lcd,FOURMB_IOC_MCAS,&kv);
+	printf("ioctl_test: stale cas = %d (%s), current %s\n",k,strerror(errno),kv.old);
+	k = ioctl(lcd,FOURMB_IOC_MCAS,&kv);
+	printf("ioctl_test: cas = %d, previous %s\n",k,kv.old);
+}
+
 int main(int argc, char** argv) {
 	lcd = open("/dev/fourmb_device_driver",O_RDWR);
 	if(lcd == -1) {
@@ -45,6 +80,7 @@ int main(int argc, char** argv) {
 	}
 
 	test();
+	test_meta();
 	close(lcd);
 	
 	return 0;
@@ -6,96 +6,189 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/proc_fs.h>
-#include <asm/uaccess.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/version.h>
+#include <linux/uaccess.h>
 
 #define MAJOR_NUMBER 61 	// You can also try to get the device number automatically
 
+/* vm_flags became read only in 6.3 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+#define onebyte_vm_flags_clear(vma,flags)	vm_flags_clear(vma,flags)
+#else
+#define onebyte_vm_flags_clear(vma,flags)	((vma)->vm_flags &= ~(flags))
+#endif
+
 /* forward declaration */
 int onebyte_open(struct inode* inode, struct file* filep);
 int onebyte_release(struct inode* inode, struct file* filep);
 ssize_t onebyte_read(struct file* filep, char* buf, size_t count, loff_t* f_pos);
 ssize_t onebyte_write(struct file* filep, const char* buf, size_t count, loff_t* f_pos);
+int onebyte_mmap(struct file* filep, struct vm_area_struct* vma);
 
 /* definition of file operation structure */
 struct file_operations onebyte_fops = {
+	.owner = THIS_MODULE,	/* open files and mappings pin the module */
 	.read = onebyte_read,
 	.write = onebyte_write,
 	.open = onebyte_open,
 	.release = onebyte_release,
+	.mmap = onebyte_mmap,
+};
+
+/* The Shared Register :
+ * ---------------------
+ *
+ * The value lives in a page that readers
+ * mmap read-only, so polling it costs no
+ * syscall (same idea as the vDSO clock).
+ * Writers serialize on onebyte_lock and bump
+ * seq around the update, seq is odd while a
+ * write is in flight. A reader does
+ *
+ *	do {
+ *		seq = load_acquire(&p->seq);
+ *		v   = p->value;
+ *		rmb();
+ *	} while ((seq & 1) || p->seq != seq);
+ *
+ * see onebyte_mmap_test.c for the user side.
+ * This layout is ABI, only append to it.
+ */
+struct onebyte_page {
+	u32 seq;
+	u32 width;		/* bytes of value in use */
+	u64 value;
 };
 
-static char* onebyte_data = NULL;		// Stores the Character
-static int   onebyte_numbOpens = 0;		// Number of Opens
+static int width = 1;
+module_param(width, int, S_IRUGO);
+MODULE_PARM_DESC(width, "Register width in bytes: 1, 2, 4 or 8 (default 1)");
+
+static struct onebyte_page* onebyte_data = NULL;	// Stores the register, one page
+static DEFINE_SPINLOCK(onebyte_lock);			// Serializes writers
+static atomic_t onebyte_numbOpens = ATOMIC_INIT(0);	// Number of Opens
+
+static u64 onebyte_read_value(void) {
+	u32 seq;
+	u64 value;
+
+	do {
+		seq = READ_ONCE(onebyte_data->seq);
+		smp_rmb();
+		value = READ_ONCE(onebyte_data->value);
+		smp_rmb();
+	} while ((seq & 1) || READ_ONCE(onebyte_data->seq) != seq);
+	return value;
+}
+
+static void onebyte_write_value(u64 value) {
+	spin_lock(&onebyte_lock);
+	WRITE_ONCE(onebyte_data->seq, onebyte_data->seq + 1);
+	smp_wmb();
+	WRITE_ONCE(onebyte_data->value, value);
+	smp_wmb();
+	WRITE_ONCE(onebyte_data->seq, onebyte_data->seq + 1);
+	spin_unlock(&onebyte_lock);
+}
 
 int onebyte_open(struct inode* inode, struct file* filep) {
-	onebyte_numbOpens++;
-	printk(KERN_INFO "onebyte_device: Device Successfully Opened, \
-	%d time(s)\n",onebyte_numbOpens);
+	int opens = atomic_inc_return(&onebyte_numbOpens);
+
+	printk(KERN_DEBUG "onebyte_device: Device Successfully Opened, %d time(s)\n",opens);
 	return 0;
 }
 
-int onebyte_release(struct inode* inode, struct file* filep) { 
-	printk(KERN_INFO "onebyte_device: Device Successfully Closed\n");
+int onebyte_release(struct inode* inode, struct file* filep) {
 	return 0;
 }
 
+/* returns the register once, then EOF */
 ssize_t onebyte_read(struct file* filep, char* buf, size_t count, loff_t* f_pos) {
-	int err_count = 0;
-	
-	err_count = copy_to_user(buf,onebyte_data,1);
-	
-	if(err_count == 0) {
-		printk(KERN_INFO "onebyte_device: User Space Application read one byte\n");
+	u64 value;
+
+	if(*f_pos >= width)
 		return 0;
-	}
-	else {
+	if(count > width - *f_pos)
+		count = width - *f_pos;
+
+	value = onebyte_read_value();
+	if(copy_to_user(buf,(char *)&value + *f_pos,count)) {
 		printk(KERN_INFO "onebyte_device: Failed to read the device\n");
 		return -EFAULT;
 	}
+	*f_pos += count;
+	return count;
 }
 
+/* replaces the register, short writes are zero extended */
 ssize_t onebyte_write(struct file* filep, const char* buf, size_t count, loff_t* f_pos) {
-	if(count > 1) {
-		printk(KERN_INFO "onebyte_device: Failed to write device, accepts a single byte only\n");
-		return -EFAULT;
+	u64 value = 0;
+
+	if(count == 0 || count > width) {
+		printk(KERN_INFO "onebyte_device: Failed to write device, accepts at most %d byte(s)\n",width);
+		return -EINVAL;
 	}
-	//sprintf(onebyte_data,buf);
-	*onebyte_data = buf[0];
-	printk(KERN_INFO "onebyte_device: Write Successful\n");
+	if(copy_from_user(&value,buf,count))
+		return -EFAULT;
+
+	onebyte_write_value(value);
 	return count;
 }
 
+int onebyte_mmap(struct file* filep, struct vm_area_struct* vma) {
+	if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	/* no mprotect(PROT_WRITE) later either */
+	onebyte_vm_flags_clear(vma,VM_MAYWRITE);
+	return vm_insert_page(vma,vma->vm_start,virt_to_page(onebyte_data));
+}
+
 /* LKM init modules */
 static int __init onebyte_device_init(void) {
+	int major_number;
+
 	printk(KERN_INFO "onebyte_device: Initializing the device\n");
 
-	// Try to register the device
-	int major_number = register_chrdev(MAJOR_NUMBER,"onebyte_device",&onebyte_fops);	
-	if(major_number < 0) {
-		printk(KERN_ALERT "onebyte_device: failed to register the major number\n");
-		return major_number;
+	if(width != 1 && width != 2 && width != 4 && width != 8) {
+		printk(KERN_ALERT "onebyte_device: width must be 1, 2, 4 or 8, not %d\n",width);
+		return -EINVAL;
 	}
-	
-	onebyte_data = kmalloc(sizeof(char),GFP_KERNEL);
+
+	onebyte_data = (struct onebyte_page *)get_zeroed_page(GFP_KERNEL);
 	if(!onebyte_data) {
 		printk(KERN_ALERT "onebyte_device: Memory allocation failed during initialization\n");
 		return -ENOMEM;
 	}
-	//sprintf(onebyte_data,"X");
-	*onebyte_data = 'X';
-	printk(KERN_INFO "onebyte_device: Successfully initialized one byte device\n");
+	onebyte_data->width = width;
+	onebyte_data->value = 'X';
+
+	// Try to register the device
+	major_number = register_chrdev(MAJOR_NUMBER,"onebyte_device",&onebyte_fops);
+	if(major_number < 0) {
+		printk(KERN_ALERT "onebyte_device: failed to register the major number\n");
+		free_page((unsigned long)onebyte_data);
+		onebyte_data = NULL;
+		return major_number;
+	}
+	printk(KERN_INFO "onebyte_device: Successfully initialized %d byte device\n",width);
 	return 0;
 }
 
-static int __exit onebyte_device_exit(void) {
+static void __exit onebyte_device_exit(void) {
 	printk(KERN_INFO "onebyte_device: Unloading one byte device\n");
+	unregister_chrdev(MAJOR_NUMBER,"onebyte_device");
+	/* mappings hold their own page reference */
 	if(onebyte_data) {
-		kfree(onebyte_data);
+		free_page((unsigned long)onebyte_data);
 		onebyte_data = NULL;
 	}
-	unregister_chrdev(MAJOR_NUMBER,"onebyte_device");
 	printk(KERN_INFO "onebyte_device: Successfuly unloaded\n");
-	return 0;
 }
 
 MODULE_LICENSE("GPL");
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* must match struct onebyte_page in onebyte_device_driver.c */
+struct onebyte_page {
+	uint32_t seq;
+	uint32_t width;
+	uint64_t value;
+};
+
+#define POLLS	10000000
+
+int lcd;
+
+static uint64_t poll_value(const volatile struct onebyte_page *p) {
+	uint32_t seq;
+	uint64_t value;
+
+	do {
+		seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+		value = p->value;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || p->seq != seq);
+	return value;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void test() {
+	const volatile struct onebyte_page *p;
+	uint64_t v, sum = 0;
+	char c = 'Y';
+	double start;
+	int i, k;
+
+	p = mmap(NULL, sizeof(*p), PROT_READ, MAP_SHARED, lcd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	printf("onebyte_mmap_test: width = %u, value = 0x%llx\n",
+			p->width, (unsigned long long)poll_value(p));
+
+	k = write(lcd, &c, 1);
+	printf("onebyte_mmap_test: written = %d, value = 0x%llx\n",
+			k, (unsigned long long)poll_value(p));
+
+	if (mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE, MAP_SHARED, lcd, 0) != MAP_FAILED)
+		printf("onebyte_mmap_test: FAIL writable mapping allowed\n");
+
+	start = now_ns();
+	for (i = 0; i < POLLS; i++)
+		sum += poll_value(p);
+	printf("onebyte_mmap_test: mmap poll %.1f ns/read\n", (now_ns() - start) / POLLS);
+
+	start = now_ns();
+	for (i = 0; i < POLLS / 100; i++) {
+		v = 0;
+		pread(lcd, &v, p->width, 0);
+		sum += v;
+	}
+	printf("onebyte_mmap_test: pread   %.1f ns/read (%llu)\n",
+			(now_ns() - start) / (POLLS / 100), (unsigned long long)sum);
+}
+
+int main(int argc, char **argv) {
+	lcd = open(argc > 1 ? argv[1] : "/dev/onebyte", O_RDWR);
+	if (lcd == -1) {
+		perror("unable to open lcd");
+		exit(EXIT_FAILURE);
+	}
+
+	test();
+	close(lcd);
+
+	return 0;
+}